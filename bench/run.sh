@@ -0,0 +1,159 @@
+#!/bin/sh
+#
+# bench/run.sh
+#
+# Measure what pg_ipm costs.  Every script in bench/scripts runs twice
+# under pgbench against the same server, once in plain sessions and once
+# in sessions that load pg_ipm through session_preload_libraries, and the
+# throughput in tuples per second and the p50/p99 latency of both runs
+# are reported side by side.  pg_ipm must therefore not be in
+# shared_preload_libraries of the server, and pg_ipm.rules in its
+# postgresql.conf must list the benchmark columns:
+#
+#   pg_ipm.rules = 'ipm_bench.narrow.amount, ipm_bench.big.amount, ipm_bench.wide.c01, ipm_bench.wide.c02 laplace(2), ipm_bench.wide.c03 gaussian(1), ipm_bench.wide.n01'
+#
+# The connection is taken from the usual PG* environment variables and
+# must be a superuser's.  The results go to bench/results/current.csv.
+# The script fails when the throughput of pg_ipm relative to the vanilla
+# run dropped by more than BENCH_TOLERANCE percent against
+# bench/baseline.csv, and right away when there is no baseline;
+# BENCH_SAVE=1 makes the results the new baseline instead.  Ratios rather
+# than absolute rates are compared so that a baseline carries over between
+# machines.
+#
+# Copyright 2022 Ernst-Georg Schmid
+#
+# Distributed under The PostgreSQL License
+# see License file for terms
+
+set -e
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+PGBENCH=${PGBENCH:-pgbench}
+PSQL=${PSQL:-psql}
+BENCH_TIME=${BENCH_TIME:-30}
+BENCH_CLIENTS=${BENCH_CLIENTS:-4}
+BENCH_TOLERANCE=${BENCH_TOLERANCE:-10}
+BENCH_SCRIPTS=${BENCH_SCRIPTS:-"point_lookup narrow_scan wide_scan cursor_fetch join parallel_scan"}
+
+RESULTS="$BENCH_DIR/results"
+BASELINE="$BENCH_DIR/baseline.csv"
+LOADED='-c session_preload_libraries=pg_ipm'
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+fail()
+{
+    echo "bench: $*" >&2
+    exit 1
+}
+
+if [ ! -f "$BASELINE" ] && [ "${BENCH_SAVE:-0}" != 1 ]; then
+    fail "there is no $BASELINE to compare with, store one with make bench-baseline or BENCH_SAVE=1"
+fi
+
+case ",$($PSQL -XAtc 'SHOW shared_preload_libraries')," in
+    *pg_ipm*)
+        fail "pg_ipm is in shared_preload_libraries, so there is no vanilla run to compare with"
+        ;;
+esac
+
+if [ "${BENCH_SKIP_SETUP:-0}" != 1 ]; then
+    echo "bench: creating the ipm_bench schema"
+    $PSQL -Xq -v ON_ERROR_STOP=1 -f "$BENCH_DIR/setup.sql" >/dev/null
+fi
+
+case "$(PGOPTIONS="$LOADED" $PSQL -XAtc 'SHOW pg_ipm.rules')" in
+    *ipm_bench.narrow.amount*)
+        ;;
+    *)
+        fail "pg_ipm.rules does not list the benchmark columns, see the top of $0"
+        ;;
+esac
+
+# percentile p of the latencies, in ms, in the pgbench logs with prefix $1
+percentile()
+{
+    cat "$1".* | awk '{ print $3 }' | sort -n |
+        awk -v p="$2" '{ v[NR] = $1 }
+            END { if (NR == 0) { print "0"; exit }
+                  i = int(NR * p / 100 + 0.5); if (i < 1) i = 1; if (i > NR) i = NR;
+                  printf "%.3f\n", v[i] / 1000 }'
+}
+
+# run script $1 in mode $2 and print "tps p50 p99"
+run_one()
+{
+    prefix="$TMP/$1_$2"
+
+    if [ "$2" = pg_ipm ]; then
+        options="$LOADED"
+    else
+        options=
+    fi
+
+    PGOPTIONS="$options" $PGBENCH -n -f "$BENCH_DIR/scripts/$1.sql" \
+        -T "$BENCH_TIME" -c "$BENCH_CLIENTS" -j "$BENCH_CLIENTS" \
+        -l --log-prefix="$prefix" >"$prefix.out" 2>&1 ||
+        { cat "$prefix.out" >&2; fail "pgbench failed on $1"; }
+
+    tps=$(sed -n 's/^tps = \([0-9.]*\).*/\1/p' "$prefix.out" | head -n 1)
+    echo "$tps $(percentile "$prefix" 50) $(percentile "$prefix" 99)"
+}
+
+mkdir -p "$RESULTS"
+echo "script,mode,tuples_per_s,p50_ms,p99_ms" >"$RESULTS/current.csv"
+
+printf '%-14s %-8s %14s %10s %10s %9s\n' script mode tuples/s p50_ms p99_ms overhead
+for script in $BENCH_SCRIPTS; do
+    rows=$(sed -n 's/^-- rows: *\([0-9]*\).*/\1/p' "$BENCH_DIR/scripts/$script.sql")
+
+    for mode in vanilla pg_ipm; do
+        result=$(run_one "$script" "$mode") || exit 1
+        set -- $result
+        tuples=$(awk -v tps="$1" -v rows="$rows" 'BEGIN { printf "%.0f", tps * rows }')
+        echo "$script,$mode,$tuples,$2,$3" >>"$RESULTS/current.csv"
+
+        if [ "$mode" = vanilla ]; then
+            vanilla=$tuples
+            overhead=
+        else
+            overhead=$(awk -v a="$vanilla" -v b="$tuples" \
+                'BEGIN { if (a > 0) printf "%.1f%%", (a - b) * 100 / a }')
+        fi
+        printf '%-14s %-8s %14s %10s %10s %9s\n' "$script" "$mode" "$tuples" "$2" "$3" "$overhead"
+    done
+done
+
+# the throughput of pg_ipm relative to vanilla, per script, from CSV file $1
+ratios()
+{
+    awk -F, 'NR > 1 { t[$1, $2] = $3; s[$1] = 1 }
+        END { for (k in s) if (t[k, "vanilla"] > 0)
+                  printf "%s %f\n", k, t[k, "pg_ipm"] / t[k, "vanilla"] }' "$1" | sort
+}
+
+status=0
+if [ -f "$BASELINE" ]; then
+    ratios "$BASELINE" >"$TMP/baseline.ratios"
+    ratios "$RESULTS/current.csv" >"$TMP/current.ratios"
+
+    join "$TMP/baseline.ratios" "$TMP/current.ratios" >"$TMP/joined"
+    while read -r script base current; do
+        if awk -v b="$base" -v c="$current" -v tol="$BENCH_TOLERANCE" \
+            'BEGIN { exit !(c < b * (1 - tol / 100)) }'; then
+            echo "bench: $script regressed: pg_ipm runs at $current of vanilla, baseline $base" >&2
+            status=1
+        fi
+    done <"$TMP/joined"
+
+    [ $status = 0 ] && echo "bench: no regressions against $BASELINE"
+fi
+
+if [ "${BENCH_SAVE:-0}" = 1 ]; then
+    cp "$RESULTS/current.csv" "$BASELINE"
+    echo "bench: saved the results as $BASELINE"
+fi
+
+exit $status
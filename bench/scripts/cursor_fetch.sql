@@ -0,0 +1,25 @@
+-- rows: 200
+BEGIN;
+DECLARE c NO SCROLL CURSOR FOR SELECT id, amount FROM ipm_bench.narrow;
+FETCH 10 FROM c;
+FETCH 10 FROM c;
+FETCH 10 FROM c;
+FETCH 10 FROM c;
+FETCH 10 FROM c;
+FETCH 10 FROM c;
+FETCH 10 FROM c;
+FETCH 10 FROM c;
+FETCH 10 FROM c;
+FETCH 10 FROM c;
+FETCH 10 FROM c;
+FETCH 10 FROM c;
+FETCH 10 FROM c;
+FETCH 10 FROM c;
+FETCH 10 FROM c;
+FETCH 10 FROM c;
+FETCH 10 FROM c;
+FETCH 10 FROM c;
+FETCH 10 FROM c;
+FETCH 10 FROM c;
+CLOSE c;
+COMMIT;
@@ -0,0 +1,5 @@
+-- rows: 10000
+\set lo random(1, 90000)
+SELECT w.id, w.c01, w.c02, d.label
+FROM ipm_bench.wide w JOIN ipm_bench.dim d ON d.id = w.dim_id
+WHERE w.id BETWEEN :lo AND :lo + 9999;
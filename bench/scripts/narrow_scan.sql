@@ -0,0 +1,2 @@
+-- rows: 100000
+SELECT id, amount FROM ipm_bench.narrow;
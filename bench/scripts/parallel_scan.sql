@@ -0,0 +1,5 @@
+-- rows: 20000
+SET max_parallel_workers_per_gather = 4;
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SELECT id, amount FROM ipm_bench.big WHERE id % 100 = 0;
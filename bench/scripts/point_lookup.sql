@@ -0,0 +1,3 @@
+-- rows: 1
+\set id random(1, 100000)
+SELECT val FROM ipm_bench.lookup WHERE id = :id;
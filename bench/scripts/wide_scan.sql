@@ -0,0 +1,2 @@
+-- rows: 100000
+SELECT * FROM ipm_bench.wide;
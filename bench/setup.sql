@@ -0,0 +1,64 @@
+-- Tables for the pg_ipm benchmark, see bench/run.sh.
+--
+-- The protected columns, which pg_ipm.rules has to list as shown in run.sh:
+--   ipm_bench.narrow.amount, ipm_bench.big.amount
+--   ipm_bench.wide.c01, ipm_bench.wide.c02 laplace(2),
+--   ipm_bench.wide.c03 gaussian(1), ipm_bench.wide.n01
+
+DROP SCHEMA IF EXISTS ipm_bench CASCADE;
+CREATE SCHEMA ipm_bench;
+
+-- unprotected, for the bypass path
+CREATE TABLE ipm_bench.lookup (
+    id      int PRIMARY KEY,
+    val     int NOT NULL
+);
+INSERT INTO ipm_bench.lookup
+    SELECT i, i % 1000 FROM generate_series(1, 100000) i;
+
+-- one protected int4 column
+CREATE TABLE ipm_bench.narrow (
+    id      int PRIMARY KEY,
+    amount  int NOT NULL
+);
+INSERT INTO ipm_bench.narrow
+    SELECT i, (i * 7919) % 100000 FROM generate_series(1, 100000) i;
+
+-- twenty columns, four of them protected, one of those numeric
+CREATE TABLE ipm_bench.wide (
+    id      int PRIMARY KEY,
+    c01     int,
+    c02     bigint,
+    c03     float8,
+    n01     numeric(12, 2),
+    c05     int, c06 int, c07 int, c08 int, c09 int, c10 int,
+    c11     int, c12 int, c13 int, c14 int, c15 int, c16 int,
+    t01     text,
+    t02     text,
+    dim_id  int NOT NULL
+);
+INSERT INTO ipm_bench.wide
+    SELECT i, i % 5000, i * 3, i / 7.0, (i % 100000) / 100.0,
+           i, i, i, i, i, i, i, i, i, i, i, i,
+           md5(i::text), 'row ' || i, i % 100
+    FROM generate_series(1, 100000) i;
+
+-- unprotected dimension for the join
+CREATE TABLE ipm_bench.dim (
+    id      int PRIMARY KEY,
+    label   text NOT NULL
+);
+INSERT INTO ipm_bench.dim
+    SELECT i, 'dim ' || i FROM generate_series(0, 99) i;
+
+-- large enough for a parallel scan
+CREATE TABLE ipm_bench.big (
+    id      int,
+    amount  int
+);
+INSERT INTO ipm_bench.big
+    SELECT i, i % 100000 FROM generate_series(1, 2000000) i;
+ALTER TABLE ipm_bench.big SET (parallel_workers = 4);
+
+VACUUM ANALYZE ipm_bench.lookup, ipm_bench.narrow, ipm_bench.wide,
+    ipm_bench.dim, ipm_bench.big;
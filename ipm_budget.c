@@ -0,0 +1,407 @@
+/*-------------------------------------------------------------------------
+ *
+ * ipm_budget.c
+ *
+ * Per-role privacy budget accounting.
+ *
+ * Laplace noise of scale b on a column whose values change by at most 1
+ * between neighbouring data sets is epsilon-differentially private with
+ * epsilon = 1/b, and the epsilon of all columns a query reads adds up.
+ * Every query that reads columns with Laplace rules is charged that sum
+ * once, at executor start, against the budget of the current role for
+ * the day, pg_ipm.epsilon_per_day.  What happens to a query the budget
+ * cannot pay for is chosen by pg_ipm.budget_exhausted: it fails, or it
+ * runs with noise coarsened by IPM_COARSE_FACTOR without being charged.
+ * pg_ipm.epsilon_per_query caps what a single query may spend; queries
+ * above it always fail.
+ *
+ * The leader decides on coarse noise once and records it in the hidden
+ * setting pg_ipm.query_coarse.  Parallel workers start with the leader's
+ * settings, and planner mode reads the setting when ipm_perturb() looks up
+ * a rule, so all of a query runs with the same noise even if the budget
+ * runs out while it does.
+ *
+ * The budgets live in a fixed size table in shared memory, open addressed
+ * by role OID.  A role claims its slot with a compare-and-swap and keeps
+ * it; the slot holds the day and the epsilon spent on it packed into one
+ * 64 bit word, so charging is a compare-and-swap loop on that word and
+ * never takes a lock.  Backends remember the slot of the role they last
+ * charged.
+ *
+ * Copyright 2022 Ernst-Georg Schmid
+ *
+ * Distributed under The PostgreSQL License
+ * see License file for terms
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include <math.h>
+
+#include "access/xact.h"
+#include "common/hashfn.h"
+#include "miscadmin.h"
+#include "nodes/parsenodes.h"
+#include "nodes/plannodes.h"
+#include "port/atomics.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/timestamp.h"
+
+#include "pg_ipm.h"
+
+int			ipm_max_roles = 1000;
+double		ipm_epsilon_per_query = 0.0;
+double		ipm_epsilon_per_day = 0.0;
+int			ipm_budget_policy = IPM_BUDGET_ERROR;
+bool		ipm_query_coarse = false;
+
+/* Spent epsilon is counted in millionths */
+#define MICRO_EPSILON 1000000.0
+
+/* The state of a slot: the day in the high bits, the spent epsilon below */
+#define SPENT_BITS 40
+#define SPENT_MAX ((UINT64CONST(1) << SPENT_BITS) - 1)
+#define STATE_DAY(state) ((state) >> SPENT_BITS)
+#define STATE_SPENT(state) ((state) & SPENT_MAX)
+#define MAKE_STATE(day, spent) (((day) << SPENT_BITS) | Min((spent), SPENT_MAX))
+
+typedef struct IpmBudgetSlot
+{
+    pg_atomic_uint64 state;
+    pg_atomic_uint32 roleid;    /* InvalidOid while the slot is free */
+} IpmBudgetSlot;
+
+typedef struct IpmBudgetTable
+{
+    int			nslots;
+    IpmBudgetSlot slots[FLEXIBLE_ARRAY_MEMBER];
+} IpmBudgetTable;
+
+static IpmBudgetTable *budget_table = NULL;
+
+#ifdef IPM_HAVE_SHMEM_REQUEST_HOOK
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+/* The slot of the role charged last */
+static Oid	cached_roleid = InvalidOid;
+static IpmBudgetSlot *cached_slot = NULL;
+
+/* A protected column a query reads, for counting each column once */
+typedef struct ChargedColumn
+{
+    Oid			owner;
+    AttrNumber	ident;
+} ChargedColumn;
+
+static Size
+budget_table_size(void)
+{
+    return add_size(offsetof(IpmBudgetTable, slots),
+                    mul_size(sizeof(IpmBudgetSlot), ipm_max_roles));
+}
+
+static void
+ipm_budget_shmem_request(void)
+{
+#ifdef IPM_HAVE_SHMEM_REQUEST_HOOK
+    if (prev_shmem_request_hook)
+        prev_shmem_request_hook();
+#endif
+
+    RequestAddinShmemSpace(budget_table_size());
+}
+
+static void
+ipm_budget_shmem_startup(void)
+{
+    bool		found;
+
+    if (prev_shmem_startup_hook)
+        prev_shmem_startup_hook();
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+    budget_table = (IpmBudgetTable *) ShmemInitStruct("pg_ipm budget table",
+                                                      budget_table_size(),
+                                                      &found);
+    if (!found)
+    {
+        int			i;
+
+        budget_table->nslots = ipm_max_roles;
+        for (i = 0; i < ipm_max_roles; i++)
+        {
+            pg_atomic_init_u64(&budget_table->slots[i].state, 0);
+            pg_atomic_init_u32(&budget_table->slots[i].roleid, InvalidOid);
+        }
+    }
+
+    LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Set up the shared budget table.  Must be called from _PG_init, after
+ * the GUCs are defined.
+ */
+void
+ipm_budget_init(void)
+{
+    if (!process_shared_preload_libraries_in_progress || ipm_max_roles == 0)
+        return;
+
+#ifdef IPM_HAVE_SHMEM_REQUEST_HOOK
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = ipm_budget_shmem_request;
+#else
+    ipm_budget_shmem_request();
+#endif
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = ipm_budget_shmem_startup;
+}
+
+void
+ipm_budget_fini(void)
+{
+    if (!process_shared_preload_libraries_in_progress || ipm_max_roles == 0)
+        return;
+
+#ifdef IPM_HAVE_SHMEM_REQUEST_HOOK
+    shmem_request_hook = prev_shmem_request_hook;
+#endif
+    shmem_startup_hook = prev_shmem_startup_hook;
+}
+
+/*
+ * Find or claim the slot of role roleid.  Returns NULL if the table is
+ * full.
+ */
+static IpmBudgetSlot *
+find_slot(Oid roleid)
+{
+    uint32		start;
+    int			i;
+
+    if (roleid == cached_roleid)
+        return cached_slot;
+
+    start = murmurhash32((uint32) roleid) % budget_table->nslots;
+    for (i = 0; i < budget_table->nslots; i++)
+    {
+        IpmBudgetSlot *slot = &budget_table->slots[(start + i) % budget_table->nslots];
+        uint32		owner = pg_atomic_read_u32(&slot->roleid);
+
+        if (owner == InvalidOid)
+        {
+            /* on failure, owner is set to whoever was faster */
+            if (pg_atomic_compare_exchange_u32(&slot->roleid, &owner, roleid))
+                owner = roleid;
+        }
+
+        if (owner == roleid)
+        {
+            cached_roleid = roleid;
+            cached_slot = slot;
+            return slot;
+        }
+    }
+
+    return NULL;
+}
+
+/* The current day, in UTC, since the PostgreSQL epoch */
+static inline uint64
+current_day(void)
+{
+    TimestampTz now = GetCurrentStatementStartTimestamp();
+
+    return (now > 0) ? (uint64) (now / USECS_PER_DAY) : 0;
+}
+
+static inline uint64
+to_micro(double epsilon)
+{
+    return (uint64) rint(epsilon * MICRO_EPSILON);
+}
+
+/*
+ * The epsilon, in millionths, a query spends by reading the protected
+ * columns of the relations in its range table.  The partitions of a
+ * table share its rules and are counted once.
+ */
+static uint64
+query_cost(PlannedStmt *plannedstmt, float8 factor)
+{
+    ChargedColumn *charged = NULL;
+    int			ncharged = 0;
+    int			maxcharged = 0;
+    IpmRelationRules *lastrules = NULL;
+    uint64		cost = 0;
+    ListCell   *lc;
+
+    ipm_rules_refresh();
+
+    foreach(lc, plannedstmt->rtable)
+    {
+        RangeTblEntry *rte = (RangeTblEntry *) lfirst(lc);
+        IpmRelationRules *rules;
+        int			i;
+
+        if (rte->rtekind != RTE_RELATION)
+            continue;
+
+        rules = ipm_lookup_inherited_rules(rte->relid);
+        if (rules == NULL || rules == lastrules)
+            continue;
+        lastrules = rules;
+
+        for (i = 0; i < rules->ncolumns; i++)
+        {
+            IpmColumnRule *column = &rules->columns[i];
+            int			j;
+
+            if (column->noise.dist != IPM_DIST_LAPLACE)
+                continue;
+
+            for (j = 0; j < ncharged; j++)
+            {
+                if (charged[j].owner == column->owner &&
+                    charged[j].ident == column->ident)
+                    break;
+            }
+            if (j < ncharged)
+                continue;
+
+            if (ncharged == maxcharged)
+            {
+                maxcharged = Max(maxcharged * 2, 8);
+                if (charged == NULL)
+                    charged = (ChargedColumn *) palloc(sizeof(ChargedColumn) * maxcharged);
+                else
+                    charged = (ChargedColumn *) repalloc(charged,
+                                                         sizeof(ChargedColumn) * maxcharged);
+            }
+            charged[ncharged].owner = column->owner;
+            charged[ncharged].ident = column->ident;
+            ncharged++;
+
+            cost += Max(to_micro(1.0 / (column->noise.scale * factor)), 1);
+        }
+    }
+
+    if (charged != NULL)
+        pfree(charged);
+
+    return cost;
+}
+
+/*
+ * Charge the query of plannedstmt to the budget of the current role,
+ * whose policy scales the noise by factor.  Returns true if the query has
+ * to run with coarse noise, because the day's budget is used up and
+ * pg_ipm.budget_exhausted = coarsen.
+ */
+static bool
+charge_query(PlannedStmt *plannedstmt, float8 factor)
+{
+    IpmBudgetSlot *slot;
+    uint64		cost;
+    uint64		limit;
+    uint64		today;
+    uint64		state;
+
+    if (ipm_epsilon_per_query <= 0.0 && ipm_epsilon_per_day <= 0.0)
+        return false;
+
+    cost = query_cost(plannedstmt, factor);
+    if (cost == 0)
+        return false;
+
+    if (ipm_epsilon_per_query > 0.0 && cost > to_micro(ipm_epsilon_per_query))
+        ereport(ERROR,
+                (errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
+                 errmsg("query exceeds pg_ipm.epsilon_per_query"),
+                 errdetail("The query needs epsilon %g, %g is allowed.",
+                           cost / MICRO_EPSILON, ipm_epsilon_per_query)));
+
+    if (ipm_epsilon_per_day <= 0.0)
+        return false;
+
+    if (budget_table == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pg_ipm.epsilon_per_day requires pg_ipm in shared_preload_libraries and pg_ipm.max_roles > 0")));
+
+    slot = find_slot(GetUserId());
+    if (slot == NULL)
+    {
+        if (ipm_budget_policy == IPM_BUDGET_COARSEN)
+            return true;
+        ereport(ERROR,
+                (errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
+                 errmsg("pg_ipm has no budget left for another role"),
+                 errhint("Increase pg_ipm.max_roles.")));
+    }
+
+    limit = to_micro(ipm_epsilon_per_day);
+    today = current_day();
+
+    state = pg_atomic_read_u64(&slot->state);
+
+    for (;;)
+    {
+        uint64		spent = (STATE_DAY(state) == today) ? STATE_SPENT(state) : 0;
+        uint64		newstate;
+
+        if (spent + cost > limit)
+        {
+            /*
+             * With coarse noise as the fallback, what is left is forfeited,
+             * so all further queries of the day see a consistent state.
+             */
+            if (ipm_budget_policy == IPM_BUDGET_COARSEN && spent < limit &&
+                !pg_atomic_compare_exchange_u64(&slot->state, &state,
+                                                MAKE_STATE(today, limit)))
+                continue;
+
+            if (ipm_budget_policy == IPM_BUDGET_COARSEN)
+                return true;
+
+            ereport(ERROR,
+                    (errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
+                     errmsg("privacy budget of role \"%s\" is exhausted for today",
+                            GetUserNameFromId(GetUserId(), false)),
+                     errdetail("The query needs epsilon %g, %g is left.",
+                               cost / MICRO_EPSILON,
+                               (spent < limit) ? (limit - spent) / MICRO_EPSILON : 0.0)));
+        }
+
+        newstate = MAKE_STATE(today, spent + cost);
+        if (pg_atomic_compare_exchange_u64(&slot->state, &state, newstate))
+            return false;
+    }
+}
+
+/*
+ * Charge the query of plannedstmt like charge_query() and record in
+ * pg_ipm.query_coarse whether it runs with coarse noise.  Call once per
+ * query, in the leader, before the executor enters parallel mode, where
+ * settings cannot change.  A query nested in a parallel one has no workers
+ * of its own, so the setting keeps the decision for the outer query.
+ */
+bool
+ipm_budget_charge(PlannedStmt *plannedstmt, float8 factor)
+{
+    bool		coarse = charge_query(plannedstmt, factor);
+
+    if (coarse != ipm_query_coarse && !IsInParallelMode())
+        (void) set_config_option("pg_ipm.query_coarse", coarse ? "on" : "off",
+                                 PGC_SUSET, PGC_S_SESSION, GUC_ACTION_SET,
+                                 true, 0, false);
+
+    return coarse;
+}
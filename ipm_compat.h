@@ -0,0 +1,76 @@
+/*-------------------------------------------------------------------------
+ *
+ * ipm_compat.h
+ *
+ * What differs between the PostgreSQL major versions pg_ipm builds for.
+ *
+ * One source builds for PostgreSQL 14 and later.  Everything that depends
+ * on the server version is decided here or in #if blocks on
+ * PG_VERSION_NUM, at compile time, so that no version check is left in
+ * the code that runs per query or per tuple:
+ *
+ * - 14 has no shmem_request_hook; shared memory is requested right from
+ *   _PG_init, see IPM_HAVE_SHMEM_REQUEST_HOOK.
+ * - 16 allocates GUC extra data with guc_malloc instead of malloc, and
+ *   marks Vars nulled by outer joins in varnullingrels.
+ * - 17 numbers backends by ProcNumber instead of BackendId, passes
+ *   decoded tuples as plain HeapTuples, has EXPLAIN (MEMORY) and custom
+ *   wait events.
+ * - 18 drops execute_once from ExecutorRun and splits commands/explain.h.
+ *
+ * Copyright 2022 Ernst-Georg Schmid
+ *
+ * Distributed under The PostgreSQL License
+ * see License file for terms
+ *-------------------------------------------------------------------------
+ */
+#ifndef IPM_COMPAT_H
+#define IPM_COMPAT_H
+
+#if PG_VERSION_NUM < 140000
+#error "pg_ipm requires PostgreSQL 14 or later"
+#endif
+
+#if PG_VERSION_NUM >= 150000
+#define IPM_HAVE_SHMEM_REQUEST_HOOK
+#endif
+
+#if PG_VERSION_NUM >= 160000
+#define IPM_HAVE_NULLINGRELS
+#define ipm_guc_malloc(size) guc_malloc(LOG, (size))
+#define ipm_guc_free(ptr) guc_free(ptr)
+#else
+#define ipm_guc_malloc(size) malloc(size)
+#define ipm_guc_free(ptr) free(ptr)
+#endif
+
+/*
+ * The index of this backend in per-backend arrays of MaxBackends entries,
+ * or -1 for processes without one.
+ */
+#if PG_VERSION_NUM >= 170000
+#include "storage/procnumber.h"
+#define IPM_MY_BACKEND_INDEX() \
+    ((MyProcNumber == INVALID_PROC_NUMBER) ? -1 : (int) MyProcNumber)
+#else
+#include "storage/backendid.h"
+#define IPM_MY_BACKEND_INDEX() \
+    ((MyBackendId == InvalidBackendId) ? -1 : (int) MyBackendId - 1)
+#endif
+
+/* The HeapTuple of a decoded change's tuple, or NULL */
+#if PG_VERSION_NUM >= 170000
+#define IPM_DECODED_TUPLE(tuple) (tuple)
+#else
+#define IPM_DECODED_TUPLE(buf) ((buf) != NULL ? &(buf)->tuple : NULL)
+#endif
+
+#if PG_VERSION_NUM >= 170000
+#define IPM_HAVE_CUSTOM_WAIT_EVENTS
+#endif
+
+#if PG_VERSION_NUM < 180000
+#define IPM_HAVE_EXECUTE_ONCE
+#endif
+
+#endif							/* IPM_COMPAT_H */
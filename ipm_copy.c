@@ -0,0 +1,139 @@
+/*-------------------------------------------------------------------------
+ *
+ * ipm_copy.c
+ *
+ * Protect COPY table TO.
+ *
+ * COPY of a table reads the heap directly and never runs the executor, so
+ * neither the executor hooks nor the planner rewrite get to see its values.
+ * A ProcessUtility hook therefore turns COPY of a protected table into
+ * COPY of the query SELECT * FROM ONLY table, much like the rewrite COPY
+ * does itself for tables with row level security.  The query runs through
+ * the executor like any other and is perturbed there; the executor hooks
+ * give COPY the batched perturbation even when pg_ipm.batch_size is 0.
+ * COPY of unprotected tables is left alone.
+ *
+ * The query always reads whole rows, even if the COPY has a column list.
+ * Executor mode only perturbs the tuples of a scan, and selecting the
+ * columns in the query would project them into tuples that no longer tell
+ * which relation they come from.  The column list is kept on the COPY
+ * instead, which then picks the columns from the perturbed rows.
+ *
+ * Copyright 2022 Ernst-Georg Schmid
+ *
+ * Distributed under The PostgreSQL License
+ * see License file for terms
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "catalog/namespace.h"
+#include "catalog/pg_class.h"
+#include "nodes/makefuncs.h"
+#include "nodes/parsenodes.h"
+#include "nodes/plannodes.h"
+#include "tcop/utility.h"
+#include "utils/lsyscache.h"
+
+#include "pg_ipm.h"
+
+static ProcessUtility_hook_type prev_ProcessUtility_hook = NULL;
+
+/*
+ * Is stmt a COPY TO of a protected table?
+ */
+static bool
+copies_protected_table(CopyStmt *stmt)
+{
+    IpmRelationRules *rules;
+    Oid         relid;
+
+    if (stmt->is_from || stmt->relation == NULL)
+        return false;
+
+    relid = RangeVarGetRelid(stmt->relation, AccessShareLock, true);
+    if (!OidIsValid(relid) || get_rel_relkind(relid) != RELKIND_RELATION)
+        return false;
+
+    ipm_rules_refresh();
+    rules = ipm_lookup_inherited_rules(relid);
+
+    return rules != NULL && rules->ncolumns > 0;
+}
+
+/*
+ * SELECT * FROM ONLY <the table of stmt>, as a raw parse tree.
+ */
+static Node *
+make_copy_query(CopyStmt *stmt)
+{
+    SelectStmt *select = makeNode(SelectStmt);
+    ColumnRef  *cr = makeNode(ColumnRef);
+    ResTarget  *target = makeNode(ResTarget);
+    RangeVar   *from;
+
+    cr->fields = list_make1(makeNode(A_Star));
+    cr->location = -1;
+
+    target->val = (Node *) cr;
+    target->location = -1;
+
+    from = copyObject(stmt->relation);
+    from->inh = false;          /* COPY table TO does not copy children */
+
+    select->targetList = list_make1(target);
+    select->fromClause = list_make1(from);
+
+    return (Node *) select;
+}
+
+/*
+ * ProcessUtility hook: run COPY of a protected table as COPY of a query.
+ * The statement is copied rather than changed, since it may belong to a
+ * cached plan.
+ */
+static void
+ipm_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
+                   bool readOnlyTree, ProcessUtilityContext context,
+                   ParamListInfo params, QueryEnvironment *queryEnv,
+                   DestReceiver *dest, QueryCompletion *qc)
+{
+    Node       *parsetree = pstmt->utilityStmt;
+
+    if (IsA(parsetree, CopyStmt) && copies_protected_table((CopyStmt *) parsetree))
+    {
+        CopyStmt   *stmt = (CopyStmt *) parsetree;
+        CopyStmt   *newstmt = makeNode(CopyStmt);
+        PlannedStmt *newpstmt = makeNode(PlannedStmt);
+
+        memcpy(newstmt, stmt, sizeof(CopyStmt));
+        newstmt->relation = NULL;
+        newstmt->query = make_copy_query(stmt);
+
+        memcpy(newpstmt, pstmt, sizeof(PlannedStmt));
+        newpstmt->utilityStmt = (Node *) newstmt;
+
+        pstmt = newpstmt;
+    }
+
+    if (prev_ProcessUtility_hook)
+        prev_ProcessUtility_hook(pstmt, queryString, readOnlyTree, context,
+                                 params, queryEnv, dest, qc);
+    else
+        standard_ProcessUtility(pstmt, queryString, readOnlyTree, context,
+                                params, queryEnv, dest, qc);
+}
+
+void
+ipm_copy_init(void)
+{
+    prev_ProcessUtility_hook = ProcessUtility_hook;
+    ProcessUtility_hook = ipm_ProcessUtility;
+}
+
+void
+ipm_copy_fini(void)
+{
+    ProcessUtility_hook = prev_ProcessUtility_hook;
+}
@@ -0,0 +1,437 @@
+/*-------------------------------------------------------------------------
+ *
+ * ipm_decode.c
+ *
+ * pg_ipm as a logical decoding output plugin.
+ *
+ * Logical decoding replays the changes from WAL and never runs a query,
+ * so a replication slot created with another output plugin sees the
+ * stored values.  Created with the pg_ipm plugin instead,
+ *
+ *     SELECT pg_create_logical_replication_slot('cdc', 'pg_ipm');
+ *
+ * the slot runs the plugin named by pg_ipm.decoding_plugin, pgoutput by
+ * default, with the protected columns of every inserted or updated row
+ * perturbed before that plugin sees them.  pg_ipm takes over
+ * the wrapped plugin's callbacks as they are and only interposes on the
+ * change callbacks, so the wrapped plugin keeps its private state, its
+ * options and its protocol.
+ *
+ * Columns of pass-by-value types are perturbed right in the decoded tuple:
+ * the tuple is walked once and the new values are stored over the old
+ * ones, which have the same width.  Only tuples with numeric rules, or
+ * with protected columns added after the row was written, are formed
+ * anew.  Decoding has no query and no row identity, so there is no
+ * privacy budget to charge and keyed noise is keyed by the value itself.
+ * The policy of the role that decodes applies, and pg_ipm.sample_rate
+ * selects changes, or with keyed noise values, like planner mode does for
+ * values without a row identity.
+ *
+ * Subscribers find the row an update or a delete changes by its replica
+ * identity, which the old tuple carries, so it has to arrive unchanged.
+ * Protected columns in the replica identity are refused, and old tuples,
+ * which then hold no protected values, are passed on as they are.
+ *
+ * Copyright 2022 Ernst-Georg Schmid
+ *
+ * Distributed under The PostgreSQL License
+ * see License file for terms
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "access/htup_details.h"
+#include "access/sysattr.h"
+#include "access/tupmacs.h"
+#include "catalog/pg_type.h"
+#include "fmgr.h"
+#include "replication/logical.h"
+#include "replication/output_plugin.h"
+#include "replication/reorderbuffer.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/relcache.h"
+
+#include "pg_ipm.h"
+#include "ipm_random.h"
+
+char	   *ipm_decoding_plugin = NULL;
+
+/* The callbacks of the wrapped plugin */
+static OutputPluginCallbacks inner;
+
+/*
+ * Holds the target and the tuples formed anew for a change, reset after
+ * every change.  It is a child of the decoding context and goes away
+ * with it.
+ */
+static MemoryContext decode_cxt = NULL;
+
+/* Selects what is perturbed, for the sample rate it was set up with */
+static IpmSampler sampler;
+static double sampler_rate = -1.0;
+
+/*
+ * One protected column, with the kernel for its type.
+ */
+typedef struct DecodeColumn
+{
+    AttrNumber  attnum;
+    Oid         typid;
+    Oid         owner;
+    AttrNumber  ident;
+    IpmNoiseSpec noise;
+    IpmKernel   kernel;
+} DecodeColumn;
+
+/*
+ * The protected columns of the relation a change belongs to.
+ */
+typedef struct DecodeTarget
+{
+    int         ncolumns;
+    AttrNumber  max_attnum;
+    bool        in_place;       /* all columns are pass-by-value */
+    DecodeColumn columns[FLEXIBLE_ARRAY_MEMBER];
+} DecodeTarget;
+
+void		_PG_output_plugin_init(OutputPluginCallbacks *cb);
+
+/*
+ * Bind the rules of relation to kernels, or return NULL if it has none.
+ * The noise is scaled by factor, of the role's policy.  The result lives
+ * in decode_cxt.
+ */
+static DecodeTarget *
+bind_decode_target(Relation relation, float8 factor)
+{
+    IpmRelationRules *rules;
+    DecodeTarget *target;
+    Bitmapset  *identity;
+    bool        full;
+    int         i;
+
+    ipm_rules_refresh();
+    rules = ipm_lookup_inherited_rules(RelationGetRelid(relation));
+    if (rules == NULL || rules->ncolumns == 0)
+        return NULL;
+
+    full = (relation->rd_rel->relreplident == REPLICA_IDENTITY_FULL);
+    identity = full ? NULL : RelationGetIdentityKeyBitmap(relation);
+
+    target = (DecodeTarget *) MemoryContextAlloc(decode_cxt,
+                                                 offsetof(DecodeTarget, columns) +
+                                                 sizeof(DecodeColumn) * rules->ncolumns);
+    target->ncolumns = 0;
+    target->max_attnum = 0;
+    target->in_place = true;
+
+    for (i = 0; i < rules->ncolumns; i++)
+    {
+        IpmColumnRule *rule = &rules->columns[i];
+        DecodeColumn *column = &target->columns[target->ncolumns];
+        IpmBatchKernel batch_kernel;
+        Form_pg_attribute attr;
+
+        if (rule->attnum > RelationGetNumberOfAttributes(relation))
+            ereport(ERROR,
+                    (errcode(ERRCODE_UNDEFINED_COLUMN),
+                     errmsg("pg_ipm rule for relation %u refers to nonexistent column %d",
+                            RelationGetRelid(relation), rule->attnum)));
+        attr = TupleDescAttr(RelationGetDescr(relation), rule->attnum - 1);
+        if (attr->attisdropped)
+            continue;
+
+        if (full ||
+            bms_is_member(rule->attnum - FirstLowInvalidHeapAttributeNumber,
+                          identity))
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("pg_ipm cannot perturb column \"%s\" of relation \"%s\" in the replica identity",
+                            NameStr(attr->attname), RelationGetRelationName(relation)),
+                     errdetail("Subscribers find the rows that change by their replica identity.")));
+
+        if (!ipm_lookup_kernels(rule->typid, &column->kernel, &batch_kernel))
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("pg_ipm cannot perturb column \"%s\" of relation \"%s\"",
+                            NameStr(attr->attname), RelationGetRelationName(relation))));
+
+        column->attnum = rule->attnum;
+        column->typid = rule->typid;
+        column->owner = rule->owner;
+        column->ident = rule->ident;
+        column->noise = rule->noise;
+        column->noise.scale *= factor;
+        if (!rule->typbyval)
+            target->in_place = false;
+        target->max_attnum = Max(target->max_attnum, rule->attnum);
+        target->ncolumns++;
+    }
+
+    bms_free(identity);
+
+    return (target->ncolumns > 0) ? target : NULL;
+}
+
+/*
+ * Perturb one value.  Keyed noise samples by value.
+ */
+static inline Datum
+decode_value(DecodeColumn *column, Datum value)
+{
+    uint64      valuehash;
+
+    if (ipm_noise != IPM_NOISE_KEYED)
+        return column->kernel(value, ipm_random_u64(), &column->noise);
+
+    if (column->typid == NUMERICOID)
+        valuehash = DatumGetUInt64(DirectFunctionCall2(hash_numeric_extended,
+                                                       value,
+                                                       UInt64GetDatum(0)));
+    else
+        valuehash = (uint64) value;
+
+    if (sampler.active &&
+        !ipm_sample_keyed(&sampler, ipm_keyed_value_word(InvalidOid, 0, valuehash)))
+        return value;
+
+    return column->kernel(value,
+                          ipm_keyed_value_word(column->owner, column->ident, valuehash),
+                          &column->noise);
+}
+
+/*
+ * Perturb the pass-by-value protected columns of tuple where they are
+ * stored.  The walk follows heap_deform_tuple, and stops after the last
+ * protected column.
+ */
+static void
+perturb_in_place(HeapTuple tuple, TupleDesc tupdesc, DecodeTarget *target)
+{
+    HeapTupleHeader tup = tuple->t_data;
+    bool        hasnulls = HeapTupleHasNulls(tuple);
+    bits8      *bp = tup->t_bits;
+    char       *tp = (char *) tup + tup->t_hoff;
+    uint32      off = 0;
+    int         next = 0;
+    int         attnum;
+
+    for (attnum = 0; attnum < target->max_attnum; attnum++)
+    {
+        Form_pg_attribute att = TupleDescAttr(tupdesc, attnum);
+        DecodeColumn *column = &target->columns[next];
+        bool        is_protected = (column->attnum == attnum + 1);
+
+        if (hasnulls && att_isnull(attnum, bp))
+        {
+            if (is_protected)
+                next++;
+            continue;
+        }
+
+        off = att_align_pointer(off, att->attalign, att->attlen, tp + off);
+
+        if (is_protected)
+        {
+            Datum       value = decode_value(column, fetchatt(att, tp + off));
+
+            store_att_byval(tp + off, value, att->attlen);
+            next++;
+        }
+
+        off = att_addlength_pointer(off, att->attlen, tp + off);
+    }
+}
+
+/*
+ * Form a perturbed copy of tuple in decode_cxt.
+ */
+static HeapTuple
+perturb_copy(HeapTuple tuple, TupleDesc tupdesc, DecodeTarget *target)
+{
+    MemoryContext oldcontext = MemoryContextSwitchTo(decode_cxt);
+    Datum      *values = (Datum *) palloc(sizeof(Datum) * tupdesc->natts);
+    bool       *isnull = (bool *) palloc(sizeof(bool) * tupdesc->natts);
+    HeapTuple   result;
+    int         i;
+
+    heap_deform_tuple(tuple, tupdesc, values, isnull);
+
+    for (i = 0; i < target->ncolumns; i++)
+    {
+        DecodeColumn *column = &target->columns[i];
+        int         col = column->attnum - 1;
+
+        if (isnull[col])
+            continue;
+
+        values[col] = decode_value(column, values[col]);
+    }
+
+    result = heap_form_tuple(tupdesc, values, isnull);
+    result->t_self = tuple->t_self;
+    result->t_tableOid = tuple->t_tableOid;
+
+    MemoryContextSwitchTo(oldcontext);
+
+    return result;
+}
+
+/*
+ * Perturb one decoded tuple.  It is changed where it is, or pointed at a
+ * perturbed copy; the caller restores *saved afterwards in that case.
+ */
+static void
+perturb_decoded(HeapTuple tuple, TupleDesc tupdesc,
+                DecodeTarget *target, HeapTupleData *saved)
+{
+    if (tuple == NULL)
+        return;
+
+    if (target->in_place &&
+        HeapTupleHeaderGetNatts(tuple->t_data) >= target->max_attnum)
+        perturb_in_place(tuple, tupdesc, target);
+    else
+    {
+        HeapTuple   copy = perturb_copy(tuple, tupdesc, target);
+
+        *saved = *tuple;
+        tuple->t_data = copy->t_data;
+        tuple->t_len = copy->t_len;
+    }
+}
+
+static void
+restore_decoded(HeapTuple tuple, HeapTupleData *saved)
+{
+    if (tuple != NULL && saved->t_data != NULL)
+        *tuple = *saved;
+}
+
+static void
+forget_decode_cxt(void *arg)
+{
+    decode_cxt = NULL;
+}
+
+/*
+ * Perturb the new tuple of change, hand it to callback and put the tuple
+ * back the way it was, so that the reorder buffer frees what it
+ * allocated.
+ */
+static void
+perturb_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+               Relation relation, ReorderBufferChange *change,
+               LogicalDecodeChangeCB callback)
+{
+    DecodeTarget *target = NULL;
+    const IpmPolicy *policy;
+    HeapTupleData saved;
+
+    if (decode_cxt == NULL)
+    {
+        MemoryContextCallback *callback;
+
+        decode_cxt = AllocSetContextCreate(ctx->context,
+                                           "pg_ipm decoding",
+                                           ALLOCSET_DEFAULT_SIZES);
+        callback = (MemoryContextCallback *)
+            MemoryContextAlloc(ctx->context, sizeof(MemoryContextCallback));
+        callback->func = forget_decode_cxt;
+        callback->arg = NULL;
+        MemoryContextRegisterResetCallback(ctx->context, callback);
+    }
+
+    if (sampler_rate != ipm_sample_rate)
+    {
+        ipm_sampler_init(&sampler, ipm_sample_rate, &ipm_random);
+        sampler_rate = ipm_sample_rate;
+    }
+
+    /* members of exempt roles get the stored values */
+    policy = ipm_current_policy();
+    if (!policy->exempt)
+    {
+        switch (change->action)
+        {
+            case REORDER_BUFFER_CHANGE_INSERT:
+            case REORDER_BUFFER_CHANGE_UPDATE:
+            case REORDER_BUFFER_CHANGE_DELETE:
+                target = bind_decode_target(relation, policy->factor);
+                break;
+            default:
+                break;
+        }
+    }
+
+    /* deletes carry only the old tuple, which is passed on as it is */
+    if (target == NULL ||
+        change->action == REORDER_BUFFER_CHANGE_DELETE ||
+        (sampler.active && ipm_noise != IPM_NOISE_KEYED &&
+         !ipm_sample_next(&sampler)))
+    {
+        callback(ctx, txn, relation, change);
+        MemoryContextReset(decode_cxt);
+        return;
+    }
+
+    if (ipm_noise == IPM_NOISE_KEYED)
+        ipm_keyed_prepare();
+
+    saved.t_data = NULL;
+    perturb_decoded(IPM_DECODED_TUPLE(change->data.tp.newtuple),
+                    RelationGetDescr(relation), target, &saved);
+
+    callback(ctx, txn, relation, change);
+
+    restore_decoded(IPM_DECODED_TUPLE(change->data.tp.newtuple), &saved);
+    MemoryContextReset(decode_cxt);
+}
+
+static void
+ipm_decode_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+                  Relation relation, ReorderBufferChange *change)
+{
+    perturb_change(ctx, txn, relation, change, inner.change_cb);
+}
+
+static void
+ipm_decode_stream_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+                         Relation relation, ReorderBufferChange *change)
+{
+    perturb_change(ctx, txn, relation, change, inner.stream_change_cb);
+}
+
+/*
+ * Output plugin entry point: load the wrapped plugin and take over its
+ * callbacks.
+ */
+void
+_PG_output_plugin_init(OutputPluginCallbacks *cb)
+{
+    LogicalOutputPluginInit plugin_init;
+
+    if (ipm_decoding_plugin == NULL || ipm_decoding_plugin[0] == '\0' ||
+        strcmp(ipm_decoding_plugin, "pg_ipm") == 0)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("pg_ipm.decoding_plugin must name another output plugin")));
+
+    plugin_init = (LogicalOutputPluginInit)
+        load_external_function(ipm_decoding_plugin, "_PG_output_plugin_init",
+                               false, NULL);
+    if (plugin_init == NULL)
+        elog(ERROR, "output plugins have to declare the _PG_output_plugin_init symbol");
+
+    memset(&inner, 0, sizeof(inner));
+    plugin_init(&inner);
+
+    *cb = inner;
+    if (inner.change_cb != NULL)
+        cb->change_cb = ipm_decode_change;
+    if (inner.stream_change_cb != NULL)
+        cb->stream_change_cb = ipm_decode_stream_change;
+}
@@ -0,0 +1,182 @@
+/*-------------------------------------------------------------------------
+ *
+ * ipm_explain.c
+ *
+ * What pg_ipm adds to the output of EXPLAIN.
+ *
+ * EXPLAIN VERBOSE shows the mode and the kernels pg_ipm runs with.
+ * EXPLAIN ANALYZE in executor mode also shows how many rules the query
+ * applied, how many rows it perturbed and, with TIMING, how long that took,
+ * so that a slow plan tells whether pg_ipm is to blame.  The numbers are
+ * collected by the executor hooks; this file only points them at the
+ * query being explained and prints them after the plan.
+ *
+ * Copyright 2022 Ernst-Georg Schmid
+ *
+ * Distributed under The PostgreSQL License
+ * see License file for terms
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "commands/explain.h"
+#if PG_VERSION_NUM >= 180000
+#include "commands/explain_format.h"
+#include "commands/explain_state.h"
+#endif
+#include "executor/instrument.h"
+#include "optimizer/optimizer.h"
+#include "portability/instr_time.h"
+#include "tcop/tcopprot.h"
+#include "utils/memutils.h"
+
+#include "pg_ipm.h"
+
+IpmExplainInfo *ipm_explain_query = NULL;
+
+static ExplainOneQuery_hook_type prev_ExplainOneQuery_hook = NULL;
+
+/*
+ * Plan and explain query the way ExplainOneQuery does without a hook,
+ * collecting into info while the plan runs.
+ */
+static void
+explain_one_query(Query *query, int cursorOptions, IntoClause *into,
+                  ExplainState *es, const char *queryString,
+                  ParamListInfo params, QueryEnvironment *queryEnv,
+                  IpmExplainInfo *info)
+{
+    PlannedStmt *plan;
+    instr_time  planstart;
+    instr_time  planduration;
+    BufferUsage bufusage_start;
+    BufferUsage bufusage;
+#if PG_VERSION_NUM >= 170000
+    MemoryContextCounters mem_counters;
+    MemoryContext planner_ctx = NULL;
+    MemoryContext saved_ctx = NULL;
+
+    if (es->memory)
+    {
+        planner_ctx = AllocSetContextCreate(CurrentMemoryContext,
+                                            "explain analyze planner context",
+                                            ALLOCSET_DEFAULT_SIZES);
+        saved_ctx = MemoryContextSwitchTo(planner_ctx);
+    }
+#endif
+
+    if (es->buffers)
+        bufusage_start = pgBufferUsage;
+    INSTR_TIME_SET_CURRENT(planstart);
+
+    plan = pg_plan_query(query, queryString, cursorOptions, params);
+
+    INSTR_TIME_SET_CURRENT(planduration);
+    INSTR_TIME_SUBTRACT(planduration, planstart);
+
+#if PG_VERSION_NUM >= 170000
+    if (es->memory)
+    {
+        MemoryContextSwitchTo(saved_ctx);
+        MemoryContextMemConsumed(planner_ctx, &mem_counters);
+    }
+#endif
+
+    if (es->buffers)
+    {
+        memset(&bufusage, 0, sizeof(BufferUsage));
+        BufferUsageAccumDiff(&bufusage, &pgBufferUsage, &bufusage_start);
+    }
+
+    /* planning may run queries of its own, so only point at ours now */
+    ipm_explain_query = info;
+#if PG_VERSION_NUM >= 170000
+    ExplainOnePlan(plan, into, es, queryString, params, queryEnv,
+                   &planduration, (es->buffers ? &bufusage : NULL),
+                   (es->memory ? &mem_counters : NULL));
+#else
+    ExplainOnePlan(plan, into, es, queryString, params, queryEnv,
+                   &planduration, (es->buffers ? &bufusage : NULL));
+#endif
+}
+
+static void
+print_ipm_info(IpmExplainInfo *info, ExplainState *es)
+{
+    bool        analyzed = (es->analyze && info->executor);
+
+    if (!es->verbose && !analyzed)
+        return;
+
+    ExplainOpenGroup("IPM", NULL, false, es);
+
+    if (es->verbose)
+    {
+        ExplainPropertyText("IPM Mode",
+                            (ipm_mode == IPM_MODE_EXECUTOR) ? "executor" : "planner",
+                            es);
+        ExplainPropertyText("IPM Kernel", ipm_kernel_isa, es);
+        ExplainPropertyInteger("IPM Batch Size", NULL, ipm_batch_size, es);
+    }
+
+    if (analyzed)
+    {
+        ExplainPropertyInteger("IPM Rules Applied", NULL, info->nrules, es);
+        ExplainPropertyUInteger("IPM Rows Perturbed", NULL,
+                                info->tuples_perturbed, es);
+        if (es->timing)
+            ExplainPropertyFloat("IPM Time", "ms", info->perturb_time, 3, es);
+    }
+
+    ExplainCloseGroup("IPM", NULL, false, es);
+}
+
+/*
+ * ExplainOneQuery hook: explain the query, letting the executor hooks
+ * record what pg_ipm does to it, then add that to the output.
+ */
+static void
+ipm_ExplainOneQuery(Query *query, int cursorOptions, IntoClause *into,
+                    ExplainState *es, const char *queryString,
+                    ParamListInfo params, QueryEnvironment *queryEnv)
+{
+    IpmExplainInfo info;
+    IpmExplainInfo *save_query = ipm_explain_query;
+
+    memset(&info, 0, sizeof(info));
+
+    PG_TRY();
+    {
+        if (prev_ExplainOneQuery_hook)
+        {
+            /* the other hook plans, and may run queries doing that first */
+            ipm_explain_query = es->analyze ? &info : NULL;
+            prev_ExplainOneQuery_hook(query, cursorOptions, into, es,
+                                      queryString, params, queryEnv);
+        }
+        else
+            explain_one_query(query, cursorOptions, into, es, queryString,
+                              params, queryEnv, es->analyze ? &info : NULL);
+    }
+    PG_FINALLY();
+    {
+        ipm_explain_query = save_query;
+    }
+    PG_END_TRY();
+
+    print_ipm_info(&info, es);
+}
+
+void
+ipm_explain_init(void)
+{
+    prev_ExplainOneQuery_hook = ExplainOneQuery_hook;
+    ExplainOneQuery_hook = ipm_ExplainOneQuery;
+}
+
+void
+ipm_explain_fini(void)
+{
+    ExplainOneQuery_hook = prev_ExplainOneQuery_hook;
+}
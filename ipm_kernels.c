@@ -0,0 +1,590 @@
+/*-------------------------------------------------------------------------
+ *
+ * ipm_kernels.c
+ *
+ * Perturbation kernels, in a per-value and a batch flavour, specialized
+ * for int2, int4, int8, float4, float8 and numeric.
+ *
+ * Kernels turn one 64 bit noise word per value into noise of the column's
+ * type.  The caller supplies the words, from the random generator or from
+ * the keyed hash, so both noise modes share the kernels.
+ *
+ * The noise follows the distribution of the column's rule.  Laplace and
+ * Gaussian noise are drawn from tables built at load time for the unit
+ * scale, so a draw is a table lookup and a multiplication by the rule's
+ * scale: Laplace by inverting its CDF through a table of logarithms,
+ * Gaussian with the ziggurat method, which needs further words only for
+ * the roughly 1% of draws that fall outside its rectangles.
+ *
+ * Batch kernels gather a column into a contiguous array, add a block of
+ * noise to it in one pass and scatter the result back.  The add step is
+ * done with AVX2 or NEON where the CPU supports it, saturating like the
+ * per-value kernels; the implementation is chosen once at load time by
+ * ipm_kernels_init().
+ *
+ * Copyright 2022 Ernst-Georg Schmid
+ *
+ * Distributed under The PostgreSQL License
+ * see License file for terms
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define IPM_USE_AVX2
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define IPM_USE_NEON
+#include <arm_neon.h>
+#endif
+
+#include <math.h>
+
+#include "catalog/pg_type.h"
+#include "common/int.h"
+#include "port/pg_bitutils.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "utils/numeric.h"
+
+#include "pg_ipm.h"
+#include "ipm_random.h"
+
+/* Chunk size of the batch kernels, one random block worth of values */
+#define IPM_CHUNK IPM_RANDOM_BLOCK
+
+typedef void (*IpmAddInt64) (int64 *values, const int64 *noise, int n,
+                             int64 min, int64 max);
+typedef void (*IpmAddFloat8) (float8 *values, const float8 *noise, int n);
+
+static IpmAddInt64 add_int64;
+static IpmAddFloat8 add_float8;
+
+static void init_numeric_noise(void);
+
+const char *ipm_kernel_isa = "scalar";
+
+/* 53 random bits of word scaled to [0, 1) */
+static inline float8
+unit_uniform(uint64 word)
+{
+    return (float8) (word >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * Laplace noise of unit scale: a random sign and an Exp(1) magnitude,
+ * -ln(u) for uniform u.  u is the remaining 63 bits of the word, an
+ * integer 2^p * (1 + f) scaled by 2^-63, so -ln(u) = (63 - p) ln 2 -
+ * ln(1 + f).  p comes from the leading one bit; ln(1 + f) from a table
+ * over [0, 1], interpolated linearly with the bits below the index.  The
+ * interpolation error is below 2e-7.
+ */
+#define LAPLACE_TABLE_BITS 10
+#define LAPLACE_TABLE_SIZE (1 << LAPLACE_TABLE_BITS)
+
+static float8 ln1p_table[LAPLACE_TABLE_SIZE + 1];
+
+static void
+init_laplace_table(void)
+{
+    int         i;
+
+    for (i = 0; i <= LAPLACE_TABLE_SIZE; i++)
+        ln1p_table[i] = log1p((float8) i / LAPLACE_TABLE_SIZE);
+}
+
+/* Exp(1) from 63 random bits in the low bits of r */
+static inline float8
+exponential63(uint64 r)
+{
+    int         p;
+    uint64      m;
+    int         idx;
+    float8      t;
+
+    r |= 1;
+    p = pg_leftmost_one_pos64(r);
+    m = r << (63 - p);
+    idx = (int) ((m >> (63 - LAPLACE_TABLE_BITS)) & (LAPLACE_TABLE_SIZE - 1));
+    t = (float8) ((m >> (31 - LAPLACE_TABLE_BITS)) & UINT64CONST(0xFFFFFFFF)) *
+        (1.0 / 4294967296.0);
+
+    return (63 - p) * M_LN2 -
+        (ln1p_table[idx] + (ln1p_table[idx + 1] - ln1p_table[idx]) * t);
+}
+
+static inline float8
+unit_laplace(uint64 word)
+{
+    float8      e = exponential63(word >> 1);
+
+    return (word & 1) ? -e : e;
+}
+
+/*
+ * Exp(1) from a word, for the sampling gaps in ipm_random.c.
+ */
+float8
+ipm_exponential(uint64 word)
+{
+    return exponential63(word >> 1);
+}
+
+/*
+ * Standard normal noise with the 128 layer ziggurat of Marsaglia and Tsang.
+ * The low 7 bits of the word pick the layer, the high 32 bits the point in
+ * it.  Points outside the layer's rectangle are resolved with further
+ * words, derived deterministically from the first, so keyed noise stays a
+ * function of its word.
+ */
+#define ZIGGURAT_R 3.442619855899
+#define ZIGGURAT_V 9.91256303526217e-3
+
+static uint32 zig_k[128];
+static float8 zig_w[128];
+static float8 zig_f[128];
+
+static void
+init_ziggurat_tables(void)
+{
+    const float8 m1 = 2147483648.0;
+    float8      dn = ZIGGURAT_R;
+    float8      tn = dn;
+    float8      q = ZIGGURAT_V / exp(-0.5 * dn * dn);
+    int         i;
+
+    zig_k[0] = (uint32) ((dn / q) * m1);
+    zig_k[1] = 0;
+    zig_w[0] = q / m1;
+    zig_w[127] = dn / m1;
+    zig_f[0] = 1.0;
+    zig_f[127] = exp(-0.5 * dn * dn);
+
+    for (i = 126; i >= 1; i--)
+    {
+        dn = sqrt(-2.0 * log(ZIGGURAT_V / dn + exp(-0.5 * dn * dn)));
+        zig_k[i + 1] = (uint32) ((dn / tn) * m1);
+        tn = dn;
+        zig_f[i] = exp(-0.5 * dn * dn);
+        zig_w[i] = dn / m1;
+    }
+}
+
+/* splitmix64, to stretch one word into a stream of further words */
+static inline uint64
+next_word(uint64 *state)
+{
+    uint64      z = (*state += UINT64CONST(0x9E3779B97F4A7C15));
+
+    z = (z ^ (z >> 30)) * UINT64CONST(0xBF58476D1CE4E5B9);
+    z = (z ^ (z >> 27)) * UINT64CONST(0x94D049BB133111EB);
+    return z ^ (z >> 31);
+}
+
+static pg_noinline float8
+ziggurat_slow(uint64 word)
+{
+    uint64      state = word;
+
+    for (;;)
+    {
+        int32       hz = (int32) (word >> 32);
+        int         iz = (int) (word & 127);
+        float8      x = hz * zig_w[iz];
+
+        if (iz == 0)
+        {
+            float8      y;
+
+            /* the tail beyond R */
+            do
+            {
+                x = -log(1.0 - unit_uniform(next_word(&state))) / ZIGGURAT_R;
+                y = -log(1.0 - unit_uniform(next_word(&state)));
+            } while (y + y < x * x);
+
+            return (hz > 0) ? ZIGGURAT_R + x : -ZIGGURAT_R - x;
+        }
+
+        if (zig_f[iz] + unit_uniform(next_word(&state)) * (zig_f[iz - 1] - zig_f[iz]) <
+            exp(-0.5 * x * x))
+            return x;
+
+        word = next_word(&state);
+        hz = (int32) (word >> 32);
+        iz = (int) (word & 127);
+        if ((uint32) Abs((int64) hz) < zig_k[iz])
+            return hz * zig_w[iz];
+    }
+}
+
+static inline float8
+unit_gaussian(uint64 word)
+{
+    int32       hz = (int32) (word >> 32);
+    int         iz = (int) (word & 127);
+
+    if (likely((uint32) Abs((int64) hz) < zig_k[iz]))
+        return hz * zig_w[iz];
+
+    return ziggurat_slow(word);
+}
+
+/*
+ * Noise generators.  Integer and numeric types get integer noise: uniform
+ * in [-floor(scale), floor(scale)], or the continuous noise rounded to the
+ * nearest integer.  Floating point types get the continuous noise, uniform
+ * in [-scale, scale] or scaled Laplace or Gaussian noise.
+ */
+static inline float8
+float_noise(uint64 word, const IpmNoiseSpec *noise)
+{
+    switch (noise->dist)
+    {
+        case IPM_DIST_LAPLACE:
+            return unit_laplace(word) * noise->scale;
+        case IPM_DIST_GAUSSIAN:
+            return unit_gaussian(word) * noise->scale;
+        case IPM_DIST_UNIFORM:
+        default:
+            return (unit_uniform(word) * 2.0 - 1.0) * noise->scale;
+    }
+}
+
+/*
+ * Scales multiplied by a policy factor or an aggregate's sensitivity can
+ * exceed what ipm_word_bounded() draws from, or even the range of int64.
+ * Wider uniform noise is rounded from the continuous one, and all noise is
+ * cut off well inside int64; the addition saturates anyway.
+ */
+#define INT_NOISE_BOUNDED_MAX 2147483647.0
+#define INT_NOISE_MAX 9.0e18
+
+static inline int64
+int_noise(uint64 word, const IpmNoiseSpec *noise)
+{
+    float8      r;
+
+    if (noise->dist == IPM_DIST_UNIFORM && noise->scale <= INT_NOISE_BOUNDED_MAX)
+    {
+        int64       half = (int64) noise->scale;
+
+        return (int64) ipm_word_bounded(word, (uint32) (2 * half + 1)) - half;
+    }
+
+    r = rint(float_noise(word, noise));
+
+    return (int64) Max(Min(r, INT_NOISE_MAX), -INT_NOISE_MAX);
+}
+
+/*
+ * Integer additions saturate at the limits of the column's type, so noise
+ * moves a value near a limit onto it instead of wrapping it around to the
+ * other end of the range.
+ */
+static inline int64
+saturating_add(int64 v, int64 r, int64 min, int64 max)
+{
+    int64       result;
+
+    if (unlikely(pg_add_s64_overflow(v, r, &result)))
+        return (r > 0) ? max : min;
+
+    return Max(min, Min(max, result));
+}
+
+#define SAT_ADD16(v, r) saturating_add(v, r, PG_INT16_MIN, PG_INT16_MAX)
+#define SAT_ADD32(v, r) saturating_add(v, r, PG_INT32_MIN, PG_INT32_MAX)
+#define SAT_ADD64(v, r) saturating_add(v, r, PG_INT64_MIN, PG_INT64_MAX)
+#define FLOAT_ADD(v, r) ((v) + (r))
+
+#define SAT_ADDN16(v, r, n) add_int64(v, r, n, PG_INT16_MIN, PG_INT16_MAX)
+#define SAT_ADDN32(v, r, n) add_int64(v, r, n, PG_INT32_MIN, PG_INT32_MAX)
+#define SAT_ADDN64(v, r, n) add_int64(v, r, n, PG_INT64_MIN, PG_INT64_MAX)
+#define FLOAT_ADDN(v, r, n) add_float8(v, r, n)
+
+/*
+ * Scalar implementations of the batch additions, with the semantics of
+ * saturating_add() and FLOAT_ADD.
+ */
+static void
+add_int64_scalar(int64 *values, const int64 *noise, int n, int64 min, int64 max)
+{
+    int         i;
+
+    for (i = 0; i < n; i++)
+        values[i] = saturating_add(values[i], noise[i], min, max);
+}
+
+static void
+add_float8_scalar(float8 *values, const float8 *noise, int n)
+{
+    int         i;
+
+    for (i = 0; i < n; i++)
+        values[i] += noise[i];
+}
+
+#ifdef IPM_USE_AVX2
+
+/*
+ * AVX2 has no saturating or min/max operations on 64 bit lanes, so the
+ * sum wraps, lanes whose sign flipped against both addends are replaced by
+ * the limit on the side of the noise, and the result is clamped with
+ * compares and blends.
+ */
+__attribute__((target("avx2")))
+static void
+add_int64_avx2(int64 *values, const int64 *noise, int n, int64 min, int64 max)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i vmin = _mm256_set1_epi64x(min);
+    const __m256i vmax = _mm256_set1_epi64x(max);
+    int         i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i     v = _mm256_loadu_si256((const __m256i *) (values + i));
+        __m256i     r = _mm256_loadu_si256((const __m256i *) (noise + i));
+        __m256i     s = _mm256_add_epi64(v, r);
+        __m256i     overflow;
+        __m256i     limit;
+
+        overflow = _mm256_cmpgt_epi64(zero,
+                                      _mm256_and_si256(_mm256_xor_si256(v, s),
+                                                       _mm256_xor_si256(r, s)));
+        limit = _mm256_blendv_epi8(vmax, vmin, _mm256_cmpgt_epi64(zero, r));
+        s = _mm256_blendv_epi8(s, limit, overflow);
+        s = _mm256_blendv_epi8(s, vmax, _mm256_cmpgt_epi64(s, vmax));
+        s = _mm256_blendv_epi8(s, vmin, _mm256_cmpgt_epi64(vmin, s));
+
+        _mm256_storeu_si256((__m256i *) (values + i), s);
+    }
+    add_int64_scalar(values + i, noise + i, n - i, min, max);
+}
+
+__attribute__((target("avx2")))
+static void
+add_float8_avx2(float8 *values, const float8 *noise, int n)
+{
+    int         i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256d     v = _mm256_loadu_pd(values + i);
+        __m256d     r = _mm256_loadu_pd(noise + i);
+
+        _mm256_storeu_pd(values + i, _mm256_add_pd(v, r));
+    }
+    add_float8_scalar(values + i, noise + i, n - i);
+}
+
+#endif							/* IPM_USE_AVX2 */
+
+#ifdef IPM_USE_NEON
+
+static void
+add_int64_neon(int64 *values, const int64 *noise, int n, int64 min, int64 max)
+{
+    const int64x2_t vmin = vdupq_n_s64(min);
+    const int64x2_t vmax = vdupq_n_s64(max);
+    int         i = 0;
+
+    for (; i + 2 <= n; i += 2)
+    {
+        int64x2_t   s = vqaddq_s64(vld1q_s64((const int64_t *) (values + i)),
+                                   vld1q_s64((const int64_t *) (noise + i)));
+
+        s = vbslq_s64(vcgtq_s64(s, vmax), vmax, s);
+        s = vbslq_s64(vcltq_s64(s, vmin), vmin, s);
+        vst1q_s64((int64_t *) (values + i), s);
+    }
+    add_int64_scalar(values + i, noise + i, n - i, min, max);
+}
+
+static void
+add_float8_neon(float8 *values, const float8 *noise, int n)
+{
+    int         i = 0;
+
+    for (; i + 2 <= n; i += 2)
+        vst1q_f64(values + i, vaddq_f64(vld1q_f64(values + i),
+                                        vld1q_f64(noise + i)));
+    add_float8_scalar(values + i, noise + i, n - i);
+}
+
+#endif							/* IPM_USE_NEON */
+
+/*
+ * Generate the per-value and the batch kernel of a pass-by-value type.
+ *
+ * ctype is the SQL type's C type, atype the type the noise is added in;
+ * the narrow types are widened so that the sum cannot overflow before it
+ * is clamped to ctype, and so that they share the batch additions of int8
+ * and float8.
+ */
+#define IPM_DEFINE_KERNELS(name, ctype, atype, GET, PUT, NOISE, ADD, ADDN) \
+static Datum \
+perturb_##name(Datum value, uint64 word, const IpmNoiseSpec *spec) \
+{ \
+    atype       v = (atype) GET(value); \
+\
+    return PUT((ctype) ADD(v, (atype) NOISE(word, spec))); \
+} \
+\
+static void \
+perturb_##name##_batch(Datum *values, const uint64 *words, int nvalues, \
+                       const IpmNoiseSpec *spec) \
+{ \
+    atype       vals[IPM_CHUNK]; \
+    atype       noise[IPM_CHUNK]; \
+    int         done; \
+\
+    for (done = 0; done < nvalues; done += IPM_CHUNK) \
+    { \
+        int         n = Min(IPM_CHUNK, nvalues - done); \
+        int         i; \
+\
+        for (i = 0; i < n; i++) \
+        { \
+            vals[i] = (atype) GET(values[done + i]); \
+            noise[i] = (atype) NOISE(words[done + i], spec); \
+        } \
+\
+        ADDN(vals, noise, n); \
+\
+        for (i = 0; i < n; i++) \
+            values[done + i] = PUT((ctype) vals[i]); \
+    } \
+}
+
+IPM_DEFINE_KERNELS(int2, int16, int64, DatumGetInt16, Int16GetDatum,
+                   int_noise, SAT_ADD16, SAT_ADDN16)
+IPM_DEFINE_KERNELS(int4, int32, int64, DatumGetInt32, Int32GetDatum,
+                   int_noise, SAT_ADD32, SAT_ADDN32)
+IPM_DEFINE_KERNELS(int8, int64, int64, DatumGetInt64, Int64GetDatum,
+                   int_noise, SAT_ADD64, SAT_ADDN64)
+IPM_DEFINE_KERNELS(float4, float4, float8, DatumGetFloat4, Float4GetDatum,
+                   float_noise, FLOAT_ADD, FLOAT_ADDN)
+IPM_DEFINE_KERNELS(float8, float8, float8, DatumGetFloat8, Float8GetDatum,
+                   float_noise, FLOAT_ADD, FLOAT_ADDN)
+
+/*
+ * numeric is pass-by-reference and gets integer noise.  The small noise
+ * values are built once, so most perturbations are a single numeric_add.
+ * The result is allocated in the caller's memory context, which is the
+ * per-tuple context of the executor.
+ */
+#define NUMERIC_NOISE_MAX 64
+
+static Datum numeric_noise[2 * NUMERIC_NOISE_MAX + 1];
+
+static Datum
+perturb_numeric(Datum value, uint64 word, const IpmNoiseSpec *spec)
+{
+    int64       noise = int_noise(word, spec);
+    Datum       addend;
+
+    if (noise >= -NUMERIC_NOISE_MAX && noise <= NUMERIC_NOISE_MAX)
+        addend = numeric_noise[noise + NUMERIC_NOISE_MAX];
+    else
+        addend = NumericGetDatum(int64_to_numeric(noise));
+
+    return DirectFunctionCall2(numeric_add, value, addend);
+}
+
+static void
+perturb_numeric_batch(Datum *values, const uint64 *words, int nvalues,
+                      const IpmNoiseSpec *spec)
+{
+    int         i;
+
+    for (i = 0; i < nvalues; i++)
+        values[i] = perturb_numeric(values[i], words[i], spec);
+}
+
+static void
+init_numeric_noise(void)
+{
+    MemoryContext oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+    int         i;
+
+    for (i = 0; i < lengthof(numeric_noise); i++)
+        numeric_noise[i] = NumericGetDatum(int64_to_numeric(i - NUMERIC_NOISE_MAX));
+
+    MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Pick the add implementations for this CPU and build the noise tables.
+ * Called once from _PG_init.
+ */
+void
+ipm_kernels_init(void)
+{
+    add_int64 = add_int64_scalar;
+    add_float8 = add_float8_scalar;
+    ipm_kernel_isa = "scalar";
+
+#if defined(IPM_USE_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        add_int64 = add_int64_avx2;
+        add_float8 = add_float8_avx2;
+        ipm_kernel_isa = "avx2";
+    }
+#elif defined(IPM_USE_NEON)
+    /* NEON is mandatory on AArch64 */
+    add_int64 = add_int64_neon;
+    add_float8 = add_float8_neon;
+    ipm_kernel_isa = "neon";
+#endif
+
+    init_laplace_table();
+    init_ziggurat_tables();
+    init_numeric_noise();
+}
+
+/*
+ * Look up the kernels for base type typid.  Returns false if the type is
+ * not supported.
+ */
+bool
+ipm_lookup_kernels(Oid typid, IpmKernel *kernel, IpmBatchKernel *batch_kernel)
+{
+    switch (typid)
+    {
+        case INT2OID:
+            *kernel = perturb_int2;
+            *batch_kernel = perturb_int2_batch;
+            break;
+        case INT4OID:
+            *kernel = perturb_int4;
+            *batch_kernel = perturb_int4_batch;
+            break;
+        case INT8OID:
+            *kernel = perturb_int8;
+            *batch_kernel = perturb_int8_batch;
+            break;
+        case FLOAT4OID:
+            *kernel = perturb_float4;
+            *batch_kernel = perturb_float4_batch;
+            break;
+        case FLOAT8OID:
+            *kernel = perturb_float8;
+            *batch_kernel = perturb_float8_batch;
+            break;
+        case NUMERICOID:
+            *kernel = perturb_numeric;
+            *batch_kernel = perturb_numeric_batch;
+            break;
+        default:
+            return false;
+    }
+
+    return true;
+}
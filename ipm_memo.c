@@ -0,0 +1,248 @@
+/*-------------------------------------------------------------------------
+ *
+ * ipm_memo.c
+ *
+ * Backend-local memo of keyed perturbed values.
+ *
+ * With pg_ipm.noise = keyed a value of a row always gets the same noise,
+ * so for rows that are read over and over again, the perturbed value can
+ * be remembered instead of hashing and perturbing again.  The memo holds
+ * at most pg_ipm.memo_size kilobytes in a context of its own.  It is a
+ * set associative cache: an entry can only live in the MEMO_WAYS ways of
+ * the set its key hashes to, and a full set evicts with the CLOCK
+ * algorithm, giving a way that was hit since the hand last passed it a
+ * second chance.  The key is the rule, the row's tableoid and tid and the
+ * noise scale, and an entry is used only while the row still holds the
+ * value it was made for, which catches tids reused after VACUUM.  Only
+ * pass-by-value types are memoized.
+ *
+ * The memo is dropped when the rules or the secret change, and entries of
+ * a relation are dropped on its relcache invalidation.
+ *
+ * Copyright 2022 Ernst-Georg Schmid
+ *
+ * Distributed under The PostgreSQL License
+ * see License file for terms
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "common/hashfn.h"
+#include "storage/itemptr.h"
+#include "utils/inval.h"
+#include "utils/memutils.h"
+
+#include "pg_ipm.h"
+
+int			ipm_memo_size = 0;
+
+#define MEMO_WAYS 8
+
+typedef struct MemoEntry
+{
+    Oid         tableoid;
+    Oid         owner;
+    ItemPointerData tid;
+    AttrNumber  ident;
+    bool        valid;
+    bool        referenced;     /* hit since the hand passed */
+    float8      scale;
+    Datum       value;          /* before perturbation */
+    Datum       result;
+} MemoEntry;
+
+typedef struct MemoSet
+{
+    MemoEntry   ways[MEMO_WAYS];
+    int         hand;
+} MemoSet;
+
+static MemoryContext memo_context = NULL;
+static MemoSet *memo_sets = NULL;
+static uint32 memo_mask;
+static bool callback_registered = false;
+
+static inline MemoSet *
+memo_set(Oid owner, AttrNumber ident, Oid tableoid, ItemPointer tid)
+{
+    uint64      key;
+
+    key = ((uint64) tableoid << 32) | ItemPointerGetBlockNumberNoCheck(tid);
+    key ^= murmurhash64(((uint64) owner << 32) |
+                        ((uint64) ItemPointerGetOffsetNumberNoCheck(tid) << 16) |
+                        (uint16) ident);
+
+    return &memo_sets[murmurhash64(key) & memo_mask];
+}
+
+static inline bool
+memo_match(MemoEntry *entry, Oid owner, AttrNumber ident, Oid tableoid,
+           ItemPointer tid, float8 scale)
+{
+    return entry->valid && entry->tableoid == tableoid &&
+        ItemPointerEquals(&entry->tid, tid) && entry->owner == owner &&
+        entry->ident == ident && entry->scale == scale;
+}
+
+/*
+ * Relcache invalidation callback: drop the entries of relid, or all of
+ * them.
+ */
+static void
+memo_relcache_callback(Datum arg, Oid relid)
+{
+    uint32      i;
+    int         j;
+
+    if (memo_sets == NULL)
+        return;
+
+    if (!OidIsValid(relid))
+    {
+        ipm_memo_reset();
+        return;
+    }
+
+    for (i = 0; i <= memo_mask; i++)
+    {
+        for (j = 0; j < MEMO_WAYS; j++)
+        {
+            MemoEntry  *entry = &memo_sets[i].ways[j];
+
+            if (entry->tableoid == relid || entry->owner == relid)
+                entry->valid = false;
+        }
+    }
+}
+
+/*
+ * Allocate the sets, as many as fit into pg_ipm.memo_size, rounded down
+ * to a power of two.
+ */
+static void
+memo_create(void)
+{
+    Size        nsets = ((Size) ipm_memo_size * 1024) / sizeof(MemoSet);
+    Size        n = 1;
+
+    while (n * 2 <= nsets && n * 2 <= MaxAllocHugeSize / sizeof(MemoSet))
+        n *= 2;
+
+    if (memo_context == NULL)
+        memo_context = AllocSetContextCreate(TopMemoryContext,
+                                             "pg_ipm memo",
+                                             ALLOCSET_DEFAULT_SIZES);
+
+    memo_sets = (MemoSet *) MemoryContextAllocHuge(memo_context, sizeof(MemoSet) * n);
+    memset(memo_sets, 0, sizeof(MemoSet) * n);
+    memo_mask = (uint32) (n - 1);
+
+    if (!callback_registered)
+    {
+        CacheRegisterRelcacheCallback(memo_relcache_callback, (Datum) 0);
+        callback_registered = true;
+    }
+}
+
+/*
+ * Find the perturbed value of the row's value in the memo.  Counts the
+ * hit or miss in ipm_stats.
+ */
+bool
+ipm_memo_lookup(Oid owner, AttrNumber ident, Oid tableoid, ItemPointer tid,
+                float8 scale, Datum value, Datum *result)
+{
+    MemoSet    *set;
+    int         i;
+
+    if (memo_sets != NULL)
+    {
+        set = memo_set(owner, ident, tableoid, tid);
+        for (i = 0; i < MEMO_WAYS; i++)
+        {
+            MemoEntry  *entry = &set->ways[i];
+
+            if (memo_match(entry, owner, ident, tableoid, tid, scale) &&
+                entry->value == value)
+            {
+                entry->referenced = true;
+                *result = entry->result;
+                ipm_stats.memo_hits++;
+                return true;
+            }
+        }
+    }
+
+    ipm_stats.memo_misses++;
+    return false;
+}
+
+/*
+ * Remember result as the perturbed value of the row's value.
+ */
+void
+ipm_memo_store(Oid owner, AttrNumber ident, Oid tableoid, ItemPointer tid,
+               float8 scale, Datum value, Datum result)
+{
+    MemoSet    *set;
+    MemoEntry  *entry = NULL;
+    int         i;
+
+    if (memo_sets == NULL)
+        memo_create();
+
+    set = memo_set(owner, ident, tableoid, tid);
+
+    /* a newer value of the same row replaces the old one */
+    for (i = 0; i < MEMO_WAYS; i++)
+    {
+        if (!set->ways[i].valid ||
+            memo_match(&set->ways[i], owner, ident, tableoid, tid, scale))
+        {
+            entry = &set->ways[i];
+            break;
+        }
+    }
+
+    if (entry == NULL)
+    {
+        while (set->ways[set->hand].referenced)
+        {
+            set->ways[set->hand].referenced = false;
+            set->hand = (set->hand + 1) % MEMO_WAYS;
+        }
+        entry = &set->ways[set->hand];
+        set->hand = (set->hand + 1) % MEMO_WAYS;
+    }
+
+    entry->tableoid = tableoid;
+    entry->owner = owner;
+    entry->tid = *tid;
+    entry->ident = ident;
+    entry->scale = scale;
+    entry->value = value;
+    entry->result = result;
+    entry->valid = true;
+    entry->referenced = false;
+}
+
+/*
+ * Forget everything.  The sets are allocated again on the next store.
+ */
+void
+ipm_memo_reset(void)
+{
+    if (memo_context != NULL)
+        MemoryContextReset(memo_context);
+    memo_sets = NULL;
+}
+
+/*
+ * GUC assign hook for pg_ipm.memo_size.
+ */
+void
+ipm_assign_memo_size(int newval, void *extra)
+{
+    ipm_memo_reset();
+}
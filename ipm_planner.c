@@ -0,0 +1,1076 @@
+/*-------------------------------------------------------------------------
+ *
+ * ipm_planner.c
+ *
+ * Planner mode: compile the perturbation into the query's output
+ * expressions instead of post-processing slots in the executor.
+ *
+ * With pg_ipm.mode = planner, the planner hook rewrites every output
+ * reference to a protected column into a call of the ipm_perturb()
+ * support function, before standard_planner sees the query.  The
+ * perturbation then is an ordinary expression step: it is evaluated only
+ * for columns that are actually projected, can be JIT compiled with the
+ * rest of the projection, shows up in EXPLAIN VERBOSE, and works through
+ * joins, views and subqueries, where the executor mode cannot see where a
+ * value came from.
+ *
+ * Only output expressions are rewritten, along with the arguments of
+ * functions and VALUES lists in FROM, which can pass protected columns of
+ * lateral references on as their output, and the RETURNING lists of
+ * statements that modify data.  Quals, join conditions, sort
+ * and grouping keys still see the stored values, so index use and
+ * grouping semantics are unaffected, except for grouping and DISTINCT
+ * keys that are expressions over protected columns rather than the
+ * columns themselves, whose protected columns are perturbed within the
+ * key.
+ *
+ * For keyed noise the call also gets the tableoid and ctid of the row
+ * the value comes from.  Where a query has no rows of its own, because it
+ * aggregates, groups or removes duplicates, an output value has no row
+ * identity; it is then keyed by the value itself.
+ *
+ * What a statement writes is left alone: INSERT ... SELECT stores the
+ * values it reads.  RETURNING lists, including those of data-modifying
+ * CTEs, therefore see the stored values of the subqueries and CTEs the
+ * statement reads, and their references to protected values computed
+ * there are perturbed as a whole instead.
+ *
+ * The planner inlines SQL functions in FROM after the hook has run, so
+ * their queries would escape the rewrite.  A needs_fmgr_hook keeps it from
+ * inlining SQL set-returning functions; their queries are then planned,
+ * and rewritten, on their own when the function runs.
+ *
+ * With pg_ipm.aggregates = result, count over a protected column, and sum
+ * over one whose rule has a clamp, are not fed perturbed inputs.  Their
+ * result is perturbed instead, once per group, with the noise of the rule
+ * scaled by how much one row can change it.
+ *
+ * Copyright 2022 Ernst-Georg Schmid
+ *
+ * Distributed under The PostgreSQL License
+ * see License file for terms
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "access/genam.h"
+#include "access/htup_details.h"
+#include "access/sysattr.h"
+#include "access/table.h"
+#include "catalog/indexing.h"
+#include "catalog/pg_aggregate.h"
+#include "catalog/pg_extension.h"
+#include "catalog/pg_language.h"
+#include "catalog/pg_namespace.h"
+#include "catalog/pg_proc.h"
+#include "catalog/pg_type.h"
+#include "fmgr.h"
+#include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#include "optimizer/planner.h"
+#include "parser/parse_func.h"
+#include "parser/parsetree.h"
+#include "utils/builtins.h"
+#include "utils/fmgroids.h"
+#include "utils/lsyscache.h"
+#include "utils/plancache.h"
+#include "utils/rel.h"
+#include "utils/syscache.h"
+
+#include "pg_ipm.h"
+#include "ipm_random.h"
+
+PG_FUNCTION_INFO_V1(ipm_perturb);
+
+static planner_hook_type prev_planner_hook = NULL;
+static needs_fmgr_hook_type prev_needs_fmgr_hook = NULL;
+
+/*
+ * OIDs of ipm_perturb(anyelement, oid, int2) and of its variants with a
+ * float8 sensitivity and with (oid, tid) row identity, by number of
+ * arguments, looked up on first use
+ */
+static Oid	perturb_funcids[6];
+
+typedef struct RewriteContext
+{
+    List	   *queries;        /* current query first, then its parents */
+    bool		rowids;         /* current query's output rows are its rows */
+    bool		follow;         /* into subqueries, see protected_output */
+} RewriteContext;
+
+/* A protected column found in an expression */
+typedef struct ProtectedColumn
+{
+    Oid			owner;          /* column identity, see IpmColumnRule */
+    AttrNumber	ident;
+    Var		   *base;           /* relation Var, relative to the query */
+    bool		merged;         /* reached through a merged join column */
+    float8		clamp;          /* of the column's rule */
+} ProtectedColumn;
+
+typedef struct FindContext
+{
+    RewriteContext *rewrite;
+    Index		levelsup;       /* added to the varlevelsup of found Vars */
+    ProtectedColumn *found;
+} FindContext;
+
+static void rewrite_query(Query *query, List *parents);
+static Node *rewrite_mutator(Node *node, RewriteContext *context);
+static bool find_protected_walker(Node *node, FindContext *context);
+static bool protected_output(Query *query, AttrNumber resno, List *parents,
+                             ProtectedColumn *found);
+
+/*
+ * Does the query, or any query nested in it, scan a protected relation?
+ */
+static bool
+references_protected_walker(Node *node, void *context)
+{
+    if (node == NULL)
+        return false;
+
+    if (IsA(node, RangeTblEntry))
+    {
+        RangeTblEntry *rte = (RangeTblEntry *) node;
+
+        return rte->rtekind == RTE_RELATION &&
+            ipm_lookup_inherited_rules(rte->relid) != NULL;
+    }
+
+    if (IsA(node, Query))
+        return query_tree_walker((Query *) node, references_protected_walker,
+                                 context, QTW_EXAMINE_RTES_BEFORE);
+
+    return expression_tree_walker(node, references_protected_walker, context);
+}
+
+/*
+ * Schema of the pg_ipm extension in the current database, or InvalidOid
+ * if it is not installed.
+ */
+static Oid
+get_extension_namespace(void)
+{
+    Relation	rel;
+    ScanKeyData key;
+    SysScanDesc scan;
+    HeapTuple	tuple;
+    Oid			nspid = InvalidOid;
+
+    rel = table_open(ExtensionRelationId, AccessShareLock);
+    ScanKeyInit(&key,
+                Anum_pg_extension_extname,
+                BTEqualStrategyNumber, F_NAMEEQ,
+                CStringGetDatum("pg_ipm"));
+    scan = systable_beginscan(rel, ExtensionNameIndexId, true, NULL, 1, &key);
+
+    tuple = systable_getnext(scan);
+    if (HeapTupleIsValid(tuple))
+        nspid = ((Form_pg_extension) GETSTRUCT(tuple))->extnamespace;
+
+    systable_endscan(scan);
+    table_close(rel, AccessShareLock);
+
+    return nspid;
+}
+
+/*
+ * Find the OID of ipm_perturb() with nargs arguments in the schema of the
+ * pg_ipm extension.  Looking it up by schema rather than through
+ * search_path keeps users from substituting a function of their own.  The
+ * cached OID is revalidated cheaply through the syscache, so dropping and
+ * recreating the extension is noticed.
+ */
+static Oid
+get_perturb_funcid(int nargs)
+{
+    Oid		   *cached = &perturb_funcids[nargs];
+    Oid			nspid;
+    Oid			argtypes[5] = {ANYELEMENTOID, OIDOID, INT2OID, OIDOID, TIDOID};
+    List	   *funcname;
+
+    Assert(nargs >= 3 && nargs <= 5);
+    if (nargs == 4)
+        argtypes[3] = FLOAT8OID;
+
+    if (OidIsValid(*cached) &&
+        SearchSysCacheExists1(PROCOID, ObjectIdGetDatum(*cached)))
+        return *cached;
+
+    nspid = get_extension_namespace();
+    if (!OidIsValid(nspid))
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pg_ipm.mode is \"planner\" but extension \"pg_ipm\" is not installed in this database"),
+                 errhint("Run CREATE EXTENSION pg_ipm.")));
+
+    funcname = list_make2(makeString(get_namespace_name(nspid)),
+                          makeString("ipm_perturb"));
+    *cached = LookupFuncName(funcname, nargs, argtypes, true);
+    if (!OidIsValid(*cached))
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("extension \"pg_ipm\" is out of date"),
+                 errhint("Run ALTER EXTENSION pg_ipm UPDATE.")));
+
+    return *cached;
+}
+
+/*
+ * If var refers to a protected column, return true and describe the base
+ * column in *found.  Join alias variables are followed to the columns they
+ * stand for.
+ */
+static bool
+protected_column(Var *var, RewriteContext *context, ProtectedColumn *found)
+{
+    Query	   *query;
+    RangeTblEntry *rte;
+
+    if (var->varlevelsup >= list_length(context->queries) ||
+        var->varattno < 0)
+        return false;
+
+    query = (Query *) list_nth(context->queries, var->varlevelsup);
+    rte = rt_fetch(var->varno, query->rtable);
+
+    if (rte->rtekind == RTE_RELATION)
+    {
+        IpmRelationRules *rules = ipm_lookup_inherited_rules(rte->relid);
+        IpmColumnRule *rule;
+
+        if (rules == NULL)
+            return false;
+
+        if (var->varattno == InvalidAttrNumber)
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("pg_ipm cannot protect a whole-row reference to relation \"%s\"",
+                            get_rel_name(rte->relid))));
+
+        rule = ipm_find_rule_column(rules, var->varattno);
+        if (rule == NULL)
+            return false;
+
+        found->owner = rule->owner;
+        found->ident = rule->ident;
+        found->base = (Var *) copyObject(var);
+        found->merged = false;
+        found->clamp = rule->noise.clamp;
+        return true;
+    }
+
+    /*
+     * Outputs of subqueries and CTEs are perturbed where they are computed,
+     * except where the query is not rewritten: data-modifying CTEs, and all
+     * those a RETURNING list reads.
+     */
+    if ((rte->rtekind == RTE_SUBQUERY || rte->rtekind == RTE_CTE) &&
+        var->varattno > 0)
+    {
+        List	   *parents = list_copy_tail(context->queries, var->varlevelsup);
+        Query	   *subquery = NULL;
+
+        if (rte->rtekind == RTE_SUBQUERY)
+            subquery = rte->subquery;
+        else if (rte->ctelevelsup < list_length(parents))
+        {
+            ListCell   *lc;
+
+            parents = list_copy_tail(parents, rte->ctelevelsup);
+            foreach(lc, ((Query *) linitial(parents))->cteList)
+            {
+                CommonTableExpr *cte = (CommonTableExpr *) lfirst(lc);
+
+                if (strcmp(cte->ctename, rte->ctename) == 0)
+                    subquery = (Query *) cte->ctequery;
+            }
+        }
+
+        if (subquery != NULL &&
+            (context->follow || subquery->commandType != CMD_SELECT) &&
+            protected_output(subquery, var->varattno, parents, found))
+        {
+            found->merged = true;
+            return true;
+        }
+    }
+
+    if (rte->rtekind == RTE_JOIN && var->varattno > 0 &&
+        var->varattno <= list_length(rte->joinaliasvars))
+    {
+        Node	   *aliasvar = list_nth(rte->joinaliasvars, var->varattno - 1);
+        FindContext find;
+
+        /* Alias variables are relative to the query the join belongs to. */
+        find.rewrite = context;
+        find.levelsup = var->varlevelsup;
+        find.found = found;
+        if (find_protected_walker(aliasvar, &find))
+        {
+            /*
+             * A merged column of a FULL JOIN USING is a COALESCE of the
+             * columns of both sides, and has no single row.  Otherwise the
+             * base column is nulled by the outer joins above the join too.
+             */
+            while (IsA(aliasvar, RelabelType))
+                aliasvar = (Node *) ((RelabelType *) aliasvar)->arg;
+            if (!IsA(aliasvar, Var))
+                found->merged = true;
+#ifdef IPM_HAVE_NULLINGRELS
+            found->base->varnullingrels = bms_union(found->base->varnullingrels,
+                                                    var->varnullingrels);
+#endif
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Look for a reference to a protected column, not descending into
+ * sub-queries, unless outputs of sub-queries are followed.
+ */
+static bool
+find_protected_walker(Node *node, FindContext *context)
+{
+    if (node == NULL)
+        return false;
+
+    if (IsA(node, Var))
+    {
+        Var			shifted = *(Var *) node;
+
+        shifted.varlevelsup += context->levelsup;
+        return protected_column(&shifted, context->rewrite, context->found);
+    }
+
+    if (IsA(node, SubLink) && context->rewrite->follow)
+    {
+        SubLink    *sublink = (SubLink *) node;
+
+        if ((sublink->subLinkType == EXPR_SUBLINK ||
+             sublink->subLinkType == ARRAY_SUBLINK) &&
+            protected_output((Query *) sublink->subselect, 1,
+                             list_copy_tail(context->rewrite->queries,
+                                            context->levelsup),
+                             context->found))
+            return true;
+    }
+
+    if (IsA(node, Query))
+        return false;
+
+    return expression_tree_walker(node, find_protected_walker, (void *) context);
+}
+
+/*
+ * Is output column resno of query, a query nested in parents, computed from
+ * a protected column, which is then described in *found?  The output of a
+ * set operation is computed by each of its legs, and that of a
+ * data-modifying query by its RETURNING list.
+ */
+static bool
+protected_output(Query *query, AttrNumber resno, List *parents,
+                 ProtectedColumn *found)
+{
+    RewriteContext context;
+    FindContext find;
+    TargetEntry *tle;
+    ListCell   *lc;
+
+    context.queries = lcons(query, parents);
+    context.rowids = false;
+    context.follow = true;
+
+    if (query->setOperations != NULL)
+    {
+        foreach(lc, query->rtable)
+        {
+            RangeTblEntry *rte = (RangeTblEntry *) lfirst(lc);
+
+            if (rte->rtekind == RTE_SUBQUERY &&
+                protected_output(rte->subquery, resno, context.queries, found))
+                return true;
+        }
+        return false;
+    }
+
+    tle = get_tle_by_resno((query->commandType == CMD_SELECT) ?
+                           query->targetList : query->returningList,
+                           resno);
+    if (tle == NULL)
+        return false;
+
+    find.rewrite = &context;
+    find.levelsup = 0;
+    find.found = found;
+    return find_protected_walker((Node *) tle->expr, &find);
+}
+
+/*
+ * Build ipm_perturb(expr, owner, ident), or with row identity
+ * ipm_perturb(expr, owner, ident, tableoid, ctid) taken from the system
+ * columns of the base column's relation, nulled by the same outer joins
+ * as the base column, or for an aggregate result with a sensitivity
+ * other than 1 ipm_perturb(expr, owner, ident, sensitivity), which scales
+ * the noise of the column's rule by it.  The typmod of expr is kept with
+ * a no-op relabel, so references to the result from outer queries still
+ * see the declared column type.
+ *
+ * The call is marked COERCE_SQL_SYNTAX, which the parser only uses for
+ * functions in pg_catalog, so ipm_perturb() can tell it apart from a call
+ * written by hand.  Deparsing prints it like a plain call.
+ */
+static Expr *
+make_perturb_call(Expr *expr, ProtectedColumn *column, bool rowid,
+                  float8 sensitivity)
+{
+    Oid			type = exprType((Node *) expr);
+    int32		typmod = exprTypmod((Node *) expr);
+    Oid			collation = exprCollation((Node *) expr);
+    List	   *args;
+    Expr	   *call;
+
+    args = list_make3(expr,
+                      makeConst(OIDOID, -1, InvalidOid, sizeof(Oid),
+                                ObjectIdGetDatum(column->owner), false, true),
+                      makeConst(INT2OID, -1, InvalidOid, sizeof(int16),
+                                Int16GetDatum(column->ident), false, true));
+
+    if (rowid)
+    {
+        Var		   *base = column->base;
+        Var		   *tableoid;
+        Var		   *ctid;
+
+        tableoid = makeVar(base->varno, TableOidAttributeNumber,
+                           OIDOID, -1, InvalidOid, base->varlevelsup);
+        ctid = makeVar(base->varno, SelfItemPointerAttributeNumber,
+                       TIDOID, -1, InvalidOid, base->varlevelsup);
+#ifdef IPM_HAVE_NULLINGRELS
+        tableoid->varnullingrels = bms_copy(base->varnullingrels);
+        ctid->varnullingrels = bms_copy(base->varnullingrels);
+#endif
+        args = lappend(args, tableoid);
+        args = lappend(args, ctid);
+    }
+    else if (sensitivity != 1.0)
+        args = lappend(args, makeConst(FLOAT8OID, -1, InvalidOid, sizeof(float8),
+                                       Float8GetDatum(sensitivity), false,
+                                       FLOAT8PASSBYVAL));
+
+    call = (Expr *) makeFuncExpr(get_perturb_funcid(list_length(args)), type,
+                                 args, collation, collation,
+                                 COERCE_SQL_SYNTAX);
+
+    if (typmod >= 0)
+        call = (Expr *) makeRelabelType(call, type, typmod, collation,
+                                        COERCE_IMPLICIT_CAST);
+
+    return call;
+}
+
+/*
+ * Can the row identity of the base column be referenced where the value
+ * is emitted?  Only for a Var of the query's own rows, not merged from two
+ * sides of a join.
+ */
+static inline bool
+use_rowid(ProtectedColumn *column, RewriteContext *context)
+{
+    return context->rowids && column->base->varlevelsup == 0 &&
+        !column->merged;
+}
+
+/*
+ * A constant of the base type of a protected column, for clamping.  The
+ * bound is cut off at the limits of integer types.
+ */
+static Const *
+make_bound_const(Oid typid, float8 bound)
+{
+    Datum		value;
+
+    switch (typid)
+    {
+        case INT2OID:
+            value = Int16GetDatum((int16) Max(Min(bound, PG_INT16_MAX), PG_INT16_MIN));
+            break;
+        case INT4OID:
+            value = Int32GetDatum((int32) Max(Min(bound, PG_INT32_MAX), PG_INT32_MIN));
+            break;
+        case INT8OID:
+            value = Int64GetDatum((int64) bound);
+            break;
+        case FLOAT4OID:
+            value = Float4GetDatum((float4) bound);
+            break;
+        case FLOAT8OID:
+            value = Float8GetDatum(bound);
+            break;
+        default:
+            value = DirectFunctionCall1(float8_numeric, Float8GetDatum(bound));
+            break;
+    }
+
+    return makeConst(typid, -1, InvalidOid, get_typlen(typid), value, false,
+                     get_typbyval(typid));
+}
+
+/*
+ * LEAST(GREATEST(expr, -bound), bound), in the base type of expr
+ */
+static Expr *
+make_clamp(Expr *expr, float8 bound)
+{
+    Oid			typid = getBaseType(exprType((Node *) expr));
+    MinMaxExpr *greatest = makeNode(MinMaxExpr);
+    MinMaxExpr *least = makeNode(MinMaxExpr);
+
+    if (typid != exprType((Node *) expr))
+        expr = (Expr *) makeRelabelType(expr, typid, -1, InvalidOid,
+                                        COERCE_IMPLICIT_CAST);
+
+    greatest->minmaxtype = typid;
+    greatest->minmaxcollid = InvalidOid;
+    greatest->inputcollid = InvalidOid;
+    greatest->op = IS_GREATEST;
+    greatest->args = list_make2(expr, make_bound_const(typid, -bound));
+    greatest->location = -1;
+
+    *least = *greatest;
+    least->op = IS_LEAST;
+    least->args = list_make2(greatest, make_bound_const(typid, bound));
+
+    return (Expr *) least;
+}
+
+/*
+ * Can the result of aggref be perturbed once, with noise calibrated to how
+ * much one row can change it?  If so, describe the column in *found and
+ * return that sensitivity, else return 0.
+ *
+ * Only built-in aggregates directly over a protected column qualify, and
+ * only those whose sensitivity is bounded: count, by 1, and sum, by the
+ * clamp of the column's rule, if it has one.  The argument of the sum is
+ * clamped to it.  avg, min and max, an unclamped sum and aggregates over
+ * expressions read perturbed values instead.
+ */
+static float8
+perturbs_aggregate_result(Aggref *aggref, RewriteContext *context,
+                          ProtectedColumn *found)
+{
+    TargetEntry *arg;
+    Node	   *expr;
+    IpmKernel	kernel;
+    IpmBatchKernel batch_kernel;
+    char	   *name;
+
+    if (aggref->aggkind != AGGKIND_NORMAL || aggref->aggstar ||
+        list_length(aggref->args) != 1 ||
+        get_func_namespace(aggref->aggfnoid) != PG_CATALOG_NAMESPACE ||
+        !ipm_lookup_kernels(getBaseType(aggref->aggtype), &kernel, &batch_kernel))
+        return 0.0;
+
+    arg = linitial_node(TargetEntry, aggref->args);
+    expr = (Node *) arg->expr;
+    while (IsA(expr, RelabelType))
+        expr = (Node *) ((RelabelType *) expr)->arg;
+    if (!IsA(expr, Var) || !protected_column((Var *) expr, context, found))
+        return 0.0;
+
+    name = get_func_name(aggref->aggfnoid);
+    if (strcmp(name, "count") == 0)
+        return 1.0;
+    if (strcmp(name, "sum") != 0 || found->clamp <= 0.0)
+        return 0.0;
+
+    arg->expr = make_clamp(arg->expr, found->clamp);
+    return found->clamp;
+}
+
+static Node *
+rewrite_mutator(Node *node, RewriteContext *context)
+{
+    if (node == NULL)
+        return NULL;
+
+    if (IsA(node, Var))
+    {
+        ProtectedColumn column;
+
+        if (protected_column((Var *) node, context, &column))
+            return (Node *) make_perturb_call((Expr *) copyObject(node), &column,
+                                              use_rowid(&column, context), 1.0);
+        return node;
+    }
+
+    /* GROUPING() arguments must match the grouping expressions verbatim. */
+    if (IsA(node, GroupingFunc))
+        return node;
+
+    if (IsA(node, Aggref) && ((Aggref *) node)->agglevelsup == 0)
+    {
+        ProtectedColumn column;
+        bool		rowids = context->rowids;
+        Node	   *result;
+        float8		sensitivity;
+
+        /* The result of one group has no row identity. */
+        if (ipm_aggregates == IPM_AGGREGATES_RESULT)
+        {
+            Aggref	   *aggref = (Aggref *) copyObject(node);
+
+            sensitivity = perturbs_aggregate_result(aggref, context, &column);
+            if (sensitivity > 0.0)
+                return (Node *) make_perturb_call((Expr *) aggref, &column,
+                                                  false, sensitivity);
+        }
+
+        /* Otherwise perturb the arguments, which are evaluated per row. */
+
+        context->rowids = true;
+        result = expression_tree_mutator(node, rewrite_mutator, (void *) context);
+        context->rowids = rowids;
+
+        return result;
+    }
+
+    /*
+     * Scalar and array subqueries in an output expression produce output
+     * values themselves; other sublinks only yield booleans.
+     */
+    if (IsA(node, SubLink))
+    {
+        SubLink    *sublink = (SubLink *) node;
+
+        if (sublink->subLinkType == EXPR_SUBLINK ||
+            sublink->subLinkType == ARRAY_SUBLINK)
+            rewrite_query((Query *) sublink->subselect, context->queries);
+        return node;
+    }
+
+    return expression_tree_mutator(node, rewrite_mutator, (void *) context);
+}
+
+/*
+ * Rewrite the expressions of a function or VALUES list in FROM.  They are
+ * evaluated once per row of the FROM items they refer to, so lateral
+ * references have row identity even where the query's output has none.
+ */
+static void
+rewrite_range_function(RangeTblEntry *rte, RewriteContext *context)
+{
+    bool		rowids = context->rowids;
+    ListCell   *lc;
+
+    context->rowids = true;
+
+    if (rte->rtekind == RTE_FUNCTION)
+    {
+        foreach(lc, rte->functions)
+        {
+            RangeTblFunction *rtfunc = (RangeTblFunction *) lfirst(lc);
+
+            rtfunc->funcexpr = rewrite_mutator(rtfunc->funcexpr, context);
+        }
+    }
+    else
+        rte->values_lists = (List *) rewrite_mutator((Node *) rte->values_lists,
+                                                     context);
+
+    context->rowids = rowids;
+}
+
+/*
+ * Rewrite the output expressions of query, and those of the queries
+ * nested in it, in place.  parents are the enclosing queries, innermost
+ * first, for resolving outer references.
+ */
+static void
+rewrite_query(Query *query, List *parents)
+{
+    RewriteContext context;
+    FindContext find;
+    ProtectedColumn column;
+    Node	   *key;
+    List	   *junk = NIL;
+    ListCell   *lc;
+
+    if (query->commandType != CMD_SELECT)
+        return;
+
+    context.queries = lcons(query, parents);
+    context.rowids = !(query->hasAggs || query->groupClause != NIL ||
+                       query->groupingSets != NIL || query->distinctClause != NIL);
+    context.follow = false;
+
+    foreach(lc, query->targetList)
+    {
+        TargetEntry *tle = (TargetEntry *) lfirst(lc);
+
+        if (tle->resjunk)
+            continue;
+
+        if (tle->ressortgroupref == 0)
+        {
+            tle->expr = (Expr *) rewrite_mutator((Node *) tle->expr, &context);
+            continue;
+        }
+
+        /*
+         * The entry is also a sort, grouping or DISTINCT key, which has to
+         * keep its stored value.  Move the original to a junk entry at the
+         * end and emit the perturbed expression as a whole in its place, so
+         * the output only depends on the key itself.
+         *
+         * Only a key that is the protected column itself is perturbed as a
+         * whole.  Noise on an expression such as salary * 2 would be that
+         * of the column, keyed by the same row, and subtracting the two
+         * outputs would reveal the value; keys like salary::text have no
+         * kernel at all.  A pure sort key therefore keeps its stored value
+         * while the output is the key with its protected columns
+         * perturbed.  A grouping or DISTINCT key determines the output
+         * rows, so its protected columns are perturbed in the key itself.
+         */
+        find.rewrite = &context;
+        find.levelsup = 0;
+        find.found = &column;
+        if (!find_protected_walker((Node *) tle->expr, &find))
+            continue;
+
+        key = (Node *) tle->expr;
+        while (IsA(key, RelabelType))
+            key = (Node *) ((RelabelType *) key)->arg;
+
+        if (context.rowids || IsA(key, Var))
+        {
+            TargetEntry *keytle = flatCopyTargetEntry(tle);
+
+            keytle->resjunk = true;
+            junk = lappend(junk, keytle);
+
+            if (context.rowids)
+                tle->expr = (Expr *) rewrite_mutator((Node *) copyObject(tle->expr),
+                                                     &context);
+            else
+                tle->expr = make_perturb_call(tle->expr, &column, false, 1.0);
+            tle->ressortgroupref = 0;
+        }
+        else
+            tle->expr = (Expr *) rewrite_mutator((Node *) tle->expr, &context);
+    }
+
+    foreach(lc, junk)
+    {
+        TargetEntry *keytle = (TargetEntry *) lfirst(lc);
+
+        keytle->resno = list_length(query->targetList) + 1;
+        query->targetList = lappend(query->targetList, keytle);
+    }
+
+    /* Queries in FROM, including expanded views and set operation legs */
+    foreach(lc, query->rtable)
+    {
+        RangeTblEntry *rte = (RangeTblEntry *) lfirst(lc);
+
+        if (rte->rtekind == RTE_SUBQUERY)
+            rewrite_query(rte->subquery, context.queries);
+        else if (rte->rtekind == RTE_FUNCTION || rte->rtekind == RTE_VALUES)
+            rewrite_range_function(rte, &context);
+    }
+
+    /* data-modifying CTEs are left alone, see protected_column */
+    foreach(lc, query->cteList)
+    {
+        CommonTableExpr *cte = (CommonTableExpr *) lfirst(lc);
+
+        rewrite_query((Query *) cte->ctequery, context.queries);
+    }
+}
+
+/*
+ * Rewrite the RETURNING list of query, which modifies data.  Row identity
+ * comes from the rows the statement changes.
+ */
+static void
+rewrite_returning(Query *query)
+{
+    RewriteContext context;
+    ListCell   *lc;
+
+    context.queries = list_make1(query);
+    context.rowids = true;
+    context.follow = true;
+
+    foreach(lc, query->returningList)
+    {
+        TargetEntry *tle = (TargetEntry *) lfirst(lc);
+
+        tle->expr = (Expr *) rewrite_mutator((Node *) tle->expr, &context);
+    }
+}
+
+/*
+ * planner_hook: rewrite SELECTs, and RETURNING lists, that can see
+ * protected columns.
+ */
+static PlannedStmt *
+ipm_planner(Query *parse, const char *query_string, int cursorOptions,
+            ParamListInfo boundParams)
+{
+    if (ipm_mode == IPM_MODE_PLANNER &&
+        (parse->commandType == CMD_SELECT || parse->returningList != NIL))
+    {
+        ipm_rules_refresh();
+        if (references_protected_walker((Node *) parse, NULL))
+        {
+            if (parse->commandType == CMD_SELECT)
+                rewrite_query(parse, NIL);
+            else
+                rewrite_returning(parse);
+        }
+    }
+
+    if (prev_planner_hook)
+        return prev_planner_hook(parse, query_string, cursorOptions, boundParams);
+    else
+        return standard_planner(parse, query_string, cursorOptions, boundParams);
+}
+
+/*
+ * needs_fmgr_hook: claim SQL set-returning functions in planner mode, which
+ * keeps the planner from inlining them.  The function manager then calls
+ * them through fmgr_security_definer(), which without a fmgr_hook or SET
+ * clauses only passes the call on.
+ */
+static bool
+ipm_needs_fmgr_hook(Oid functionId)
+{
+    HeapTuple	tuple;
+    bool		result = false;
+
+    if (prev_needs_fmgr_hook && prev_needs_fmgr_hook(functionId))
+        return true;
+
+    if (ipm_mode != IPM_MODE_PLANNER)
+        return false;
+
+    tuple = SearchSysCache1(PROCOID, ObjectIdGetDatum(functionId));
+    if (HeapTupleIsValid(tuple))
+    {
+        Form_pg_proc procform = (Form_pg_proc) GETSTRUCT(tuple);
+
+        result = procform->prolang == SQLlanguageId && procform->proretset;
+        ReleaseSysCache(tuple);
+    }
+
+    return result;
+}
+
+void
+ipm_planner_init(void)
+{
+    prev_planner_hook = planner_hook;
+    planner_hook = ipm_planner;
+    prev_needs_fmgr_hook = needs_fmgr_hook;
+    needs_fmgr_hook = ipm_needs_fmgr_hook;
+}
+
+void
+ipm_planner_fini(void)
+{
+    planner_hook = prev_planner_hook;
+    needs_fmgr_hook = prev_needs_fmgr_hook;
+}
+
+/*
+ * GUC assign hook for pg_ipm.mode.  Plans made for one mode do not protect
+ * anything in the other, so cached plans have to be rebuilt.
+ */
+void
+ipm_assign_mode(int newval, void *extra)
+{
+    ResetPlanCache();
+}
+
+/*
+ * GUC assign hook for pg_ipm.aggregates.  The setting is compiled into
+ * plans, so cached plans have to be rebuilt.
+ */
+void
+ipm_assign_aggregates(int newval, void *extra)
+{
+    if (ipm_mode == IPM_MODE_PLANNER)
+        ResetPlanCache();
+}
+
+/* What ipm_perturb() keeps in fn_extra */
+typedef struct PerturbCache
+{
+    Oid			typid;          /* base type of the value */
+    IpmKernel	kernel;
+    IpmNoiseSpec noise;         /* of the column's rule */
+    IpmSampler	sampler;        /* values to perturb */
+    bool		memo;           /* pass-by-value, see ipm_memo.c */
+    bool		exempt;         /* the role's policy, see ipm_policy.c */
+} PerturbCache;
+
+/*
+ * The noise of the rule for column ident of relation owner.  A rule
+ * removed since the call was planned gets the default noise.  Queries the
+ * privacy budget could not pay for get coarse noise, see ipm_budget.c.
+ */
+static void
+lookup_rule_noise(Oid owner, AttrNumber ident, IpmNoiseSpec *noise)
+{
+    IpmRelationRules *rules;
+    IpmColumnRule *rule = NULL;
+
+    ipm_rules_refresh();
+    rules = ipm_lookup_inherited_rules(owner);
+    if (rules != NULL)
+        rule = ipm_find_rule_column(rules, ident);
+
+    if (rule != NULL)
+        *noise = rule->noise;
+    else
+    {
+        noise->dist = IPM_DIST_UNIFORM;
+        noise->scale = IPM_DEFAULT_SCALE;
+        noise->clamp = 0.0;
+    }
+
+    noise->scale *= ipm_current_policy()->factor;
+    if (ipm_query_coarse)
+        noise->scale *= IPM_COARSE_FACTOR;
+}
+
+/*
+ * ipm_perturb(value anyelement, owner oid, ident int2
+ *             [, tableoid oid, ctid tid | , sensitivity float8])
+ *             returns anyelement
+ *
+ * The support function the planner mode calls.  owner and ident identify
+ * the column, tableoid and ctid the row, for keyed noise.  Without them
+ * keyed noise depends on the value instead.  sensitivity scales the noise
+ * of the column's rule for aggregate results.  The kernel, chosen by the
+ * argument's type, and the noise of the column's rule are looked up once
+ * per call site and kept in fn_extra.  The function is strict, so NULLs
+ * never reach it.
+ *
+ * Only calls the planner mode made are served.  A call written by hand
+ * could feed the function a constant and subtract the result from the
+ * value, or look up the noise of any value, so it is refused.
+ *
+ * Values pg_ipm.sample_rate passes over are returned as they are.  With
+ * random noise every call site samples on its own; keyed noise samples
+ * by row, or by value, so the columns of a row are sampled together.
+ */
+Datum
+ipm_perturb(PG_FUNCTION_ARGS)
+{
+    PerturbCache *cache = (PerturbCache *) fcinfo->flinfo->fn_extra;
+    Datum		value = PG_GETARG_DATUM(0);
+    uint64		word;
+
+    if (cache == NULL)
+    {
+        FuncExpr   *call = (FuncExpr *) fcinfo->flinfo->fn_expr;
+        Oid			typid = get_fn_expr_argtype(fcinfo->flinfo, 0);
+        IpmBatchKernel batch_kernel;
+
+        if (call == NULL || !IsA(call, FuncExpr) ||
+            call->funcformat != COERCE_SQL_SYNTAX)
+            ereport(ERROR,
+                    (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+                     errmsg("ipm_perturb() can only be called by pg_ipm's planner mode")));
+
+        cache = (PerturbCache *) MemoryContextAlloc(fcinfo->flinfo->fn_mcxt,
+                                                    sizeof(PerturbCache));
+        if (OidIsValid(typid))
+            cache->typid = getBaseType(typid);
+        if (!OidIsValid(typid) ||
+            !ipm_lookup_kernels(cache->typid, &cache->kernel, &batch_kernel))
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("pg_ipm cannot perturb values of type %s",
+                            format_type_be(typid))));
+        lookup_rule_noise(PG_GETARG_OID(1), PG_GETARG_INT16(2), &cache->noise);
+        if (PG_NARGS() == 4)
+            cache->noise.scale *= PG_GETARG_FLOAT8(3);
+        ipm_sampler_init(&cache->sampler, ipm_sample_rate, &ipm_random);
+        cache->memo = (ipm_memo_size > 0 && cache->typid != NUMERICOID);
+        cache->exempt = ipm_current_policy()->exempt;
+        fcinfo->flinfo->fn_extra = cache;
+    }
+
+    if (cache->exempt)
+        PG_RETURN_DATUM(value);
+
+    if (ipm_noise != IPM_NOISE_KEYED)
+    {
+        if (cache->sampler.active && !ipm_sample_next(&cache->sampler))
+            PG_RETURN_DATUM(value);
+
+        word = ipm_random_u64();
+    }
+    else
+    {
+        Oid			owner = PG_GETARG_OID(1);
+        AttrNumber	ident = PG_GETARG_INT16(2);
+
+        ipm_keyed_prepare();
+
+        if (PG_NARGS() == 5)
+        {
+            Oid			tableoid = PG_GETARG_OID(3);
+            ItemPointer tid = (ItemPointer) PG_GETARG_POINTER(4);
+            Datum		result;
+
+            /* the columns of a row are sampled together */
+            if (cache->sampler.active &&
+                !ipm_sample_keyed(&cache->sampler,
+                                  ipm_keyed_sample_word(tableoid, tid)))
+                PG_RETURN_DATUM(value);
+
+            if (cache->memo &&
+                ipm_memo_lookup(owner, ident, tableoid, tid, cache->noise.scale,
+                                value, &result))
+                PG_RETURN_DATUM(result);
+
+            word = ipm_keyed_row_word(owner, ident, tableoid, tid);
+            result = cache->kernel(value, word, &cache->noise);
+            if (cache->memo)
+                ipm_memo_store(owner, ident, tableoid, tid, cache->noise.scale,
+                               value, result);
+            PG_RETURN_DATUM(result);
+        }
+        else
+        {
+            uint64		valuehash;
+
+            /* all other supported types are pass-by-value */
+            if (cache->typid == NUMERICOID)
+                valuehash = DatumGetUInt64(DirectFunctionCall2(hash_numeric_extended,
+                                                               value,
+                                                               UInt64GetDatum(0)));
+            else
+                valuehash = (uint64) value;
+
+            if (cache->sampler.active &&
+                !ipm_sample_keyed(&cache->sampler,
+                                  ipm_keyed_value_word(InvalidOid, 0, valuehash)))
+                PG_RETURN_DATUM(value);
+
+            word = ipm_keyed_value_word(owner, ident, valuehash);
+        }
+    }
+
+    PG_RETURN_DATUM(cache->kernel(value, word, &cache->noise));
+}
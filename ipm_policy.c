@@ -0,0 +1,282 @@
+/*-------------------------------------------------------------------------
+ *
+ * ipm_policy.c
+ *
+ * Per-role noise policies.
+ *
+ * pg_ipm.policies lists roles, optionally restricted to a database, with
+ * what applies to their members: exempt, meaning their queries are not
+ * perturbed at all, or a factor the noise scale of every rule is
+ * multiplied by:
+ *
+ *     pg_ipm.policies = 'etl exempt, analysts 2, interns@sales 10'
+ *
+ * The first entry whose role the current user is a member of, directly
+ * or indirectly, and whose database is the current one applies; users
+ * matching none get the rules as they are.  Superuser status does not
+ * make a role a member of anything here.
+ *
+ * The effective policy is resolved once per query, when the executor
+ * starts, and remembered per role, so that the tuple loop never sees
+ * it.  A backend only ever serves one database, so the role alone keys
+ * the cache.  The cache is reset when the setting or role memberships
+ * change.
+ *
+ * Copyright 2022 Ernst-Georg Schmid
+ *
+ * Distributed under The PostgreSQL License
+ * see License file for terms
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "commands/dbcommands.h"
+#include "miscadmin.h"
+#include "nodes/pg_list.h"
+#include "parser/scansup.h"
+#include "utils/acl.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/memutils.h"
+#include "utils/syscache.h"
+#include "utils/varlena.h"
+
+#include "pg_ipm.h"
+
+char	   *ipm_policies = NULL;
+
+/* Upper limit of a policy's factor */
+#define MAX_POLICY_FACTOR 1000000.0
+
+/* One entry of pg_ipm.policies */
+typedef struct IpmPolicySpec
+{
+    NameData    rolname;
+    NameData    datname;        /* empty for every database */
+    IpmPolicy   policy;
+} IpmPolicySpec;
+
+/* The parsed setting, as GUC extra data in a single chunk */
+typedef struct IpmPolicySpecs
+{
+    int         nspecs;
+    IpmPolicySpec specs[FLEXIBLE_ARRAY_MEMBER];
+} IpmPolicySpecs;
+
+/* Entry of the policy cache */
+typedef struct IpmRolePolicy
+{
+    Oid         roleid;         /* hash key */
+    IpmPolicy   policy;
+} IpmRolePolicy;
+
+static const IpmPolicy default_policy = {false, 1.0};
+
+static IpmPolicySpecs *current_specs = NULL;
+
+static HTAB *policy_cache = NULL;
+static bool policy_cache_stale = false;
+static bool callback_registered = false;
+
+/*
+ * Parse one list element, role[@database] followed by exempt or a
+ * factor.  Returns false on a syntax error.
+ */
+static bool
+parse_policy_spec(char *elem, IpmPolicySpec *spec)
+{
+    char	   *p;
+    char	   *end;
+    List	   *names;
+    bool		inquote = false;
+
+    memset(spec, 0, sizeof(IpmPolicySpec));
+
+    /* split off the policy, after the first space outside quotes */
+    for (p = elem; *p != '\0'; p++)
+    {
+        if (*p == '"')
+            inquote = !inquote;
+        else if (!inquote && scanner_isspace(*p))
+            break;
+    }
+    if (*p == '\0')
+        return false;
+    *p++ = '\0';
+    while (scanner_isspace(*p))
+        p++;
+
+    if (pg_strcasecmp(p, "exempt") == 0)
+    {
+        spec->policy.exempt = true;
+        spec->policy.factor = 1.0;
+    }
+    else
+    {
+        errno = 0;
+        spec->policy.factor = strtod(p, &end);
+        if (errno != 0 || end == p || *end != '\0' ||
+            !(spec->policy.factor > 0.0 && spec->policy.factor <= MAX_POLICY_FACTOR))
+            return false;
+    }
+
+    /* role or role@database, downcased and dequoted like any identifier */
+    if (!SplitIdentifierString(elem, '@', &names) ||
+        list_length(names) < 1 || list_length(names) > 2)
+        return false;
+
+    namestrcpy(&spec->rolname, (char *) linitial(names));
+    if (list_length(names) == 2)
+        namestrcpy(&spec->datname, (char *) lsecond(names));
+    list_free(names);
+    return true;
+}
+
+/*
+ * GUC check hook for pg_ipm.policies
+ */
+bool
+ipm_check_policies(char **newval, void **extra, GucSource source)
+{
+    char	   *rawstring;
+    List	   *elemlist;
+    ListCell   *lc;
+    IpmPolicySpecs *specs;
+    int			n = 0;
+
+    rawstring = pstrdup(*newval ? *newval : "");
+    if (!ipm_split_rules(rawstring, &elemlist))
+    {
+        GUC_check_errdetail("List syntax is invalid.");
+        return false;
+    }
+
+    specs = (IpmPolicySpecs *) ipm_guc_malloc(offsetof(IpmPolicySpecs, specs) +
+                                              sizeof(IpmPolicySpec) * list_length(elemlist));
+    if (specs == NULL)
+        return false;
+
+    foreach(lc, elemlist)
+    {
+        char	   *elem = (char *) lfirst(lc);
+        char	   *copy = pstrdup(elem);
+
+        if (!parse_policy_spec(copy, &specs->specs[n]))
+        {
+            GUC_check_errdetail("Invalid policy \"%s\", expected role or role@database followed by exempt or a noise factor.",
+                                elem);
+            ipm_guc_free(specs);
+            return false;
+        }
+        n++;
+    }
+    specs->nspecs = n;
+
+    *extra = specs;
+    return true;
+}
+
+/*
+ * GUC assign hook for pg_ipm.policies
+ */
+void
+ipm_assign_policies(const char *newval, void *extra)
+{
+    current_specs = (IpmPolicySpecs *) extra;
+    policy_cache_stale = true;
+}
+
+/*
+ * Syscache callback: memberships or roles changed.
+ */
+static void
+policy_syscache_callback(Datum arg, int cacheid, uint32 hashvalue)
+{
+    policy_cache_stale = true;
+}
+
+static void
+reset_policy_cache(void)
+{
+    HASHCTL		ctl;
+
+    if (policy_cache != NULL)
+        hash_destroy(policy_cache);
+
+    memset(&ctl, 0, sizeof(ctl));
+    ctl.keysize = sizeof(Oid);
+    ctl.entrysize = sizeof(IpmRolePolicy);
+    ctl.hcxt = TopMemoryContext;
+    policy_cache = hash_create("pg_ipm role policies", 16, &ctl,
+                               HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    policy_cache_stale = false;
+
+    if (!callback_registered)
+    {
+        CacheRegisterSyscacheCallback(AUTHMEMROLEMEM, policy_syscache_callback,
+                                      (Datum) 0);
+        CacheRegisterSyscacheCallback(AUTHOID, policy_syscache_callback,
+                                      (Datum) 0);
+        callback_registered = true;
+    }
+}
+
+/*
+ * The policy of role roleid in the current database, from the catalogs.
+ */
+static IpmPolicy
+resolve_policy(Oid roleid)
+{
+    char	   *datname = NULL;
+    int			i;
+
+    for (i = 0; i < current_specs->nspecs; i++)
+    {
+        IpmPolicySpec *spec = &current_specs->specs[i];
+        Oid			member;
+
+        if (NameStr(spec->datname)[0] != '\0')
+        {
+            if (datname == NULL)
+                datname = get_database_name(MyDatabaseId);
+            if (datname == NULL || strcmp(datname, NameStr(spec->datname)) != 0)
+                continue;
+        }
+
+        member = get_role_oid(NameStr(spec->rolname), true);
+        if (OidIsValid(member) && is_member_of_role_nosuper(roleid, member))
+            return spec->policy;
+    }
+
+    return default_policy;
+}
+
+/*
+ * The policy of the current user.  Call once per query.
+ */
+const IpmPolicy *
+ipm_current_policy(void)
+{
+    Oid			roleid = GetUserId();
+    IpmRolePolicy *entry;
+    IpmPolicy	policy;
+
+    if (current_specs == NULL || current_specs->nspecs == 0)
+        return &default_policy;
+
+    if (policy_cache == NULL || policy_cache_stale)
+        reset_policy_cache();
+
+    entry = (IpmRolePolicy *) hash_search(policy_cache, &roleid, HASH_FIND, NULL);
+    if (entry != NULL)
+        return &entry->policy;
+
+    /* resolve before entering, the catalog lookups may fail */
+    policy = resolve_policy(roleid);
+    entry = (IpmRolePolicy *) hash_search(policy_cache, &roleid, HASH_ENTER, NULL);
+    entry->policy = policy;
+
+    return &entry->policy;
+}
@@ -0,0 +1,53 @@
+/*-------------------------------------------------------------------------
+ *
+ * ipm_probes.h
+ *
+ * Static trace points of pg_ipm, in the pg_ipm provider.
+ *
+ * They are compiled in when the server was configured with
+ * --enable-dtrace, or with "make IPM_PROBES=1", and are empty otherwise.
+ * An enabled probe that nobody traces costs a nop instruction.  The probes
+ * and their arguments:
+ *
+ * query_start(int nrelations, int batch_size)
+ *     an executor mode query reading protected relations starts
+ * batch_done(int ntuples)
+ *     a batch is perturbed, before it is handed to the destination
+ * rule_cache_miss(Oid relid)
+ *     the rules of a relation are resolved from the catalogs
+ * bypass(bool exempt)
+ *     a query is left alone, because the role is exempt or it reads no
+ *     protected relation
+ *
+ * Copyright 2022 Ernst-Georg Schmid
+ *
+ * Distributed under The PostgreSQL License
+ * see License file for terms
+ *-------------------------------------------------------------------------
+ */
+#ifndef IPM_PROBES_H
+#define IPM_PROBES_H
+
+#if defined(ENABLE_DTRACE) || defined(USE_IPM_PROBES)
+
+#include <sys/sdt.h>
+
+#define IPM_TRACE_QUERY_START(nrelations, batch_size) \
+    DTRACE_PROBE2(pg_ipm, query_start, (int) (nrelations), (int) (batch_size))
+#define IPM_TRACE_BATCH_DONE(ntuples) \
+    DTRACE_PROBE1(pg_ipm, batch_done, (int) (ntuples))
+#define IPM_TRACE_RULE_CACHE_MISS(relid) \
+    DTRACE_PROBE1(pg_ipm, rule_cache_miss, (Oid) (relid))
+#define IPM_TRACE_BYPASS(exempt) \
+    DTRACE_PROBE1(pg_ipm, bypass, (int) (exempt))
+
+#else
+
+#define IPM_TRACE_QUERY_START(nrelations, batch_size) do {} while (0)
+#define IPM_TRACE_BATCH_DONE(ntuples) do {} while (0)
+#define IPM_TRACE_RULE_CACHE_MISS(relid) do {} while (0)
+#define IPM_TRACE_BYPASS(exempt) do {} while (0)
+
+#endif
+
+#endif							/* IPM_PROBES_H */
@@ -0,0 +1,214 @@
+/*-------------------------------------------------------------------------
+ *
+ * ipm_random.c
+ *
+ * Seeding and block refill of the per-backend random number generator,
+ * and the key of the keyed noise mode.
+ *
+ * Copyright 2022 Ernst-Georg Schmid
+ *
+ * Distributed under The PostgreSQL License
+ * see License file for terms
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include <math.h>
+
+#include "common/cryptohash.h"
+#include "common/sha2.h"
+#include "miscadmin.h"
+
+#include "pg_ipm.h"
+#include "ipm_random.h"
+
+/* pos starts out past the end, so the first draw seeds and refills. */
+IpmRandomState ipm_random = {{0, 0, 0, 0}, IPM_RANDOM_BLOCK};
+
+/* Process the state was seeded in; forked children must reseed. */
+static int	seeded_pid = 0;
+
+/* pg_ipm.secret and the SipHash key derived from it */
+char	   *ipm_secret = NULL;
+uint64		ipm_sipkey[2];
+bool		ipm_sipkey_valid = false;
+
+/*
+ * Seed from the strong random source of the server.  This happens once
+ * per backend; a library preloaded in the postmaster would otherwise hand
+ * the same state to every child.
+ */
+static void
+ipm_random_seed(IpmRandomState *state)
+{
+    if (!pg_strong_random(state->s, sizeof(state->s)))
+        ereport(ERROR,
+                (errcode(ERRCODE_INTERNAL_ERROR),
+                 errmsg("could not generate random seed")));
+
+    /* xoshiro must not be seeded with all zeros */
+    if ((state->s[0] | state->s[1] | state->s[2] | state->s[3]) == 0)
+        state->s[0] = UINT64CONST(0x9E3779B97F4A7C15);
+
+    seeded_pid = MyProcPid;
+}
+
+/*
+ * splitmix64, used to expand a user supplied seed into generator state.
+ */
+static uint64
+splitmix64(uint64 *x)
+{
+    uint64      z = (*x += UINT64CONST(0x9E3779B97F4A7C15));
+
+    z = (z ^ (z >> 30)) * UINT64CONST(0xBF58476D1CE4E5B9);
+    z = (z ^ (z >> 27)) * UINT64CONST(0x94D049BB133111EB);
+    return z ^ (z >> 31);
+}
+
+/*
+ * Reseed from a fixed seed.  Every stream number yields an independent
+ * sequence for the same seed, so the leader and each parallel worker can
+ * draw from their own reproducible stream.
+ */
+void
+ipm_random_seed_stream(IpmRandomState *state, uint64 seed, uint32 stream)
+{
+    uint64      x = seed ^ ((uint64) stream * UINT64CONST(0xD1B54A32D192ED03));
+    int         i;
+
+    for (i = 0; i < 4; i++)
+        state->s[i] = splitmix64(&x);
+
+    state->pos = IPM_RANDOM_BLOCK;
+    if (state == &ipm_random)
+        seeded_pid = MyProcPid;
+}
+
+/*
+ * Start stream state from the next values of the backend's generator.
+ */
+void
+ipm_random_split(IpmRandomState *state)
+{
+    uint64      x = ipm_random_u64();
+    int         i;
+
+    /* expanded like a seed, so the stream does not overlap the parent */
+    for (i = 0; i < 4; i++)
+        state->s[i] = splitmix64(&x);
+
+    state->pos = IPM_RANDOM_BLOCK;
+}
+
+/*
+ * Produce the next block of IPM_RANDOM_BLOCK values.
+ */
+void
+ipm_random_refill(IpmRandomState *state)
+{
+    uint64      s[4];
+    int         i;
+
+    if (unlikely(state == &ipm_random && seeded_pid != MyProcPid))
+        ipm_random_seed(state);
+
+    /* Work on a local copy so the compiler can keep the state in registers. */
+    memcpy(s, state->s, sizeof(s));
+
+    for (i = 0; i < IPM_RANDOM_BLOCK; i++)
+        state->block[i] = ipm_xoshiro_next(s);
+
+    memcpy(state->s, s, sizeof(s));
+    state->pos = 0;
+}
+
+/*
+ * GUC assign hook for pg_ipm.secret.  The key is derived on next use.
+ */
+void
+ipm_assign_secret(const char *newval, void *extra)
+{
+    ipm_sipkey_valid = false;
+}
+
+/*
+ * Derive the SipHash key from pg_ipm.secret: the first 128 bits of its
+ * SHA-256 digest.
+ */
+void
+ipm_keyed_prepare(void)
+{
+    pg_cryptohash_ctx *ctx;
+    uint8		digest[PG_SHA256_DIGEST_LENGTH];
+    bool		ok;
+
+    if (ipm_sipkey_valid)
+        return;
+
+    if (ipm_secret == NULL || ipm_secret[0] == '\0')
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pg_ipm.noise is \"keyed\" but pg_ipm.secret is not set")));
+
+    ctx = pg_cryptohash_create(PG_SHA256);
+    ok = pg_cryptohash_init(ctx) >= 0 &&
+        pg_cryptohash_update(ctx, (const uint8 *) ipm_secret, strlen(ipm_secret)) >= 0 &&
+        pg_cryptohash_final(ctx, digest, sizeof(digest)) >= 0;
+    pg_cryptohash_free(ctx);
+
+    if (!ok)
+        ereport(ERROR,
+                (errcode(ERRCODE_INTERNAL_ERROR),
+                 errmsg("could not derive the pg_ipm noise key")));
+
+    memcpy(ipm_sipkey, digest, sizeof(ipm_sipkey));
+    explicit_bzero(digest, sizeof(digest));
+    ipm_sipkey_valid = true;
+
+    /* values perturbed with another key are stale */
+    ipm_memo_reset();
+}
+
+/*
+ * Set up sampler for a sample rate in [0, 1], drawing its gaps from
+ * stream random.  The first gap is drawn right away, so the first row is
+ * no more likely to be sampled than any other.  A rate of 0 samples
+ * nothing.
+ */
+void
+ipm_sampler_init(IpmSampler *sampler, double rate, IpmRandomState *random)
+{
+    sampler->random = random;
+    sampler->active = (rate < 1.0);
+    sampler->threshold = PG_UINT64_MAX;
+    sampler->lambda = 0.0;
+    sampler->skip = 0;
+
+    if (!sampler->active)
+        return;
+
+    sampler->threshold = (uint64) ldexp(rate, 64);
+    if (rate <= 0.0)
+    {
+        sampler->skip = PG_INT64_MAX;
+        return;
+    }
+
+    sampler->lambda = -log1p(-rate);
+    sampler->skip = ipm_sampler_gap(sampler);
+}
+
+/*
+ * Number of rows before the next sampled one, geometrically distributed
+ * as floor(E / lambda) for E ~ Exp(1).
+ */
+int64
+ipm_sampler_gap(IpmSampler *sampler)
+{
+    double      gap = floor(ipm_exponential(ipm_random_next(sampler->random)) /
+                            sampler->lambda);
+
+    return (gap < (double) (PG_INT64_MAX / 2)) ? (int64) gap : PG_INT64_MAX / 2;
+}
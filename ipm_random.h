@@ -0,0 +1,287 @@
+/*-------------------------------------------------------------------------
+ *
+ * ipm_random.h
+ *
+ * Fast per-backend pseudo random numbers for the perturbation kernels.
+ *
+ * The generator is xoshiro256** (Blackman/Vigna), seeded once per backend
+ * from pg_strong_random().  Every query of the executor mode draws from a
+ * stream of its own, split off the backend's generator at executor start,
+ * so cursors that are fetched from in turn do not share one sequence, and
+ * with a fixed seed each of them is reproducible on its own.  Output is
+ * produced in blocks of IPM_RANDOM_BLOCK values, so drawing a number is a
+ * buffer read on all but every 64th call.  Bounded values use Lemire's
+ * multiply-shift reduction with rejection, which is free of modulo bias.
+ *
+ * The keyed noise mode replaces the generator by SipHash-2-4 over the
+ * identity of a row and column, keyed with a secret derived from
+ * pg_ipm.secret.  The same row then always receives the same noise, on
+ * every execution and on every physical replica.
+ *
+ * With pg_ipm.sample_rate below 1, only a fraction of the rows is
+ * perturbed.  Random noise skips the rows in between by a geometrically
+ * distributed count, drawn once per sampled row, so a skipped row costs a
+ * decrement instead of a draw.  Keyed noise samples by a keyed hash of
+ * the row, so the same rows are perturbed every time.
+ *
+ * Copyright 2022 Ernst-Georg Schmid
+ *
+ * Distributed under The PostgreSQL License
+ * see License file for terms
+ *-------------------------------------------------------------------------
+ */
+#ifndef IPM_RANDOM_H
+#define IPM_RANDOM_H
+
+#include "storage/itemptr.h"
+
+#define IPM_RANDOM_BLOCK 64
+
+typedef struct IpmRandomState
+{
+    uint64      s[4];
+    int         pos;            /* next unused entry of block */
+    uint64      block[IPM_RANDOM_BLOCK];
+} IpmRandomState;
+
+extern IpmRandomState ipm_random;
+
+extern void ipm_random_refill(IpmRandomState *state);
+extern void ipm_random_seed_stream(IpmRandomState *state, uint64 seed,
+                                   uint32 stream);
+extern void ipm_random_split(IpmRandomState *state);
+
+extern char *ipm_secret;
+extern uint64 ipm_sipkey[2];
+extern bool ipm_sipkey_valid;
+
+extern void ipm_keyed_prepare(void);
+extern void ipm_assign_secret(const char *newval, void *extra);
+
+static inline uint64
+ipm_rotl(uint64 x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+/*
+ * Advance the generator by one step.
+ */
+static inline uint64
+ipm_xoshiro_next(uint64 *s)
+{
+    uint64      result = ipm_rotl(s[1] * 5, 7) * 9;
+    uint64      t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = ipm_rotl(s[3], 45);
+
+    return result;
+}
+
+/*
+ * Next 64 random bits of stream state.
+ */
+static inline uint64
+ipm_random_next(IpmRandomState *state)
+{
+    if (unlikely(state->pos >= IPM_RANDOM_BLOCK))
+        ipm_random_refill(state);
+
+    return state->block[state->pos++];
+}
+
+/*
+ * Next 64 random bits of the backend's generator.
+ */
+static inline uint64
+ipm_random_u64(void)
+{
+    return ipm_random_next(&ipm_random);
+}
+
+/*
+ * Uniformly distributed value in [0, range).  range must not be zero.
+ */
+static inline uint32
+ipm_random_bounded(uint32 range)
+{
+    uint64      m = (ipm_random_u64() >> 32) * (uint64) range;
+    uint32      l = (uint32) m;
+
+    if (unlikely(l < range))
+    {
+        uint32      threshold = -range % range;
+
+        while (l < threshold)
+        {
+            m = (ipm_random_u64() >> 32) * (uint64) range;
+            l = (uint32) m;
+        }
+    }
+
+    return (uint32) (m >> 32);
+}
+
+/*
+ * Map 64 random bits to a value in [0, range).  Like ipm_random_bounded,
+ * but the rare rejected draw is retried with the low half of the same
+ * word instead of a fresh one, so that every value consumes exactly one
+ * word, which keyed noise relies on.  The remaining bias is below 2^-60.
+ */
+static inline uint32
+ipm_word_bounded(uint64 word, uint32 range)
+{
+    uint64      m = (word >> 32) * (uint64) range;
+
+    if (unlikely((uint32) m < range) && (uint32) m < -range % range)
+        m = (word & UINT64CONST(0xFFFFFFFF)) * (uint64) range;
+
+    return (uint32) (m >> 32);
+}
+
+/*
+ * Fill words with the next n random values of stream state.
+ */
+static inline void
+ipm_random_fill(IpmRandomState *state, uint64 *words, int n)
+{
+    int         i;
+
+    for (i = 0; i < n; i++)
+        words[i] = ipm_random_next(state);
+}
+
+#define IPM_SIPROUND(v0, v1, v2, v3) \
+    do { \
+        v0 += v1; v1 = ipm_rotl(v1, 13); v1 ^= v0; v0 = ipm_rotl(v0, 32); \
+        v2 += v3; v3 = ipm_rotl(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = ipm_rotl(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = ipm_rotl(v1, 17); v1 ^= v2; v2 = ipm_rotl(v2, 32); \
+    } while (0)
+
+/*
+ * SipHash-2-4 of the 16 byte message m0, m1 under ipm_sipkey.
+ */
+static inline uint64
+ipm_siphash(uint64 m0, uint64 m1)
+{
+    uint64      v0 = ipm_sipkey[0] ^ UINT64CONST(0x736f6d6570736575);
+    uint64      v1 = ipm_sipkey[1] ^ UINT64CONST(0x646f72616e646f6d);
+    uint64      v2 = ipm_sipkey[0] ^ UINT64CONST(0x6c7967656e657261);
+    uint64      v3 = ipm_sipkey[1] ^ UINT64CONST(0x7465646279746573);
+    uint64      b = UINT64CONST(16) << 56;
+
+    v3 ^= m0;
+    IPM_SIPROUND(v0, v1, v2, v3);
+    IPM_SIPROUND(v0, v1, v2, v3);
+    v0 ^= m0;
+
+    v3 ^= m1;
+    IPM_SIPROUND(v0, v1, v2, v3);
+    IPM_SIPROUND(v0, v1, v2, v3);
+    v0 ^= m1;
+
+    v3 ^= b;
+    IPM_SIPROUND(v0, v1, v2, v3);
+    IPM_SIPROUND(v0, v1, v2, v3);
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    IPM_SIPROUND(v0, v1, v2, v3);
+    IPM_SIPROUND(v0, v1, v2, v3);
+    IPM_SIPROUND(v0, v1, v2, v3);
+    IPM_SIPROUND(v0, v1, v2, v3);
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/*
+ * Keyed noise word for column (owner, ident) of the row at tid in
+ * relation tableoid.  The column is identified by the relation its rule
+ * is configured on and the attnum there, so a row receives the same noise
+ * whether it is read through a partitioned table or from the partition.
+ */
+static inline uint64
+ipm_keyed_row_word(Oid owner, AttrNumber ident, Oid tableoid, ItemPointer tid)
+{
+    uint64      m0 = (uint64) owner |
+        ((uint64) (uint16) ident << 32) |
+        ((uint64) ItemPointerGetOffsetNumberNoCheck(tid) << 48);
+    uint64      m1 = (uint64) tableoid |
+        ((uint64) ItemPointerGetBlockNumberNoCheck(tid) << 32);
+
+    return ipm_siphash(m0, m1);
+}
+
+/*
+ * Keyed noise word for a value of column (owner, ident) without a row
+ * identity, e.g. a grouping key.  Equal values receive equal noise.  The
+ * offset field can never be all ones in a tid, which keeps these words
+ * apart from the row words.
+ */
+static inline uint64
+ipm_keyed_value_word(Oid owner, AttrNumber ident, uint64 valuehash)
+{
+    uint64      m0 = (uint64) owner |
+        ((uint64) (uint16) ident << 32) |
+        (UINT64CONST(0xFFFF) << 48);
+
+    return ipm_siphash(m0, valuehash);
+}
+
+/*
+ * Keyed word deciding whether the row at tid of relation tableoid is
+ * sampled.  No rule is configured on InvalidOid, so it is independent of
+ * the noise words of the row.
+ */
+static inline uint64
+ipm_keyed_sample_word(Oid tableoid, ItemPointer tid)
+{
+    return ipm_keyed_row_word(InvalidOid, 0, tableoid, tid);
+}
+
+/* Row sampling state for pg_ipm.sample_rate */
+typedef struct IpmSampler
+{
+    IpmRandomState *random;     /* stream the gaps are drawn from */
+    bool        active;         /* sample rate below 1 */
+    uint64      threshold;      /* keyed: sample words below this */
+    double      lambda;         /* random: -ln(1 - rate) */
+    int64       skip;           /* random: rows to pass over */
+} IpmSampler;
+
+extern void ipm_sampler_init(IpmSampler *sampler, double rate,
+                             IpmRandomState *random);
+extern int64 ipm_sampler_gap(IpmSampler *sampler);
+
+/*
+ * Is the next row sampled?  For random noise.
+ */
+static inline bool
+ipm_sample_next(IpmSampler *sampler)
+{
+    if (sampler->skip > 0)
+    {
+        sampler->skip--;
+        return false;
+    }
+
+    sampler->skip = ipm_sampler_gap(sampler);
+    return true;
+}
+
+/*
+ * Is the row with keyed sample word word sampled?
+ */
+static inline bool
+ipm_sample_keyed(IpmSampler *sampler, uint64 word)
+{
+    return word < sampler->threshold;
+}
+
+#endif							/* IPM_RANDOM_H */
@@ -0,0 +1,1364 @@
+/*-------------------------------------------------------------------------
+ *
+ * ipm_rules.c
+ *
+ * Parsing of the pg_ipm.rules setting and the backend-local rule hash
+ * compiled from it.
+ *
+ * The setting is a comma separated list of columns, each given either by
+ * name as schema.table.column or as a relid:attnum pair, e.g.
+ *
+ *     pg_ipm.rules = 'public.orders.amount, 16390:2'
+ *
+ * Names are preferred; they do not silently move to another column when
+ * columns are dropped and added.  They are resolved in the database of
+ * the backend, once per relation, to the attnum and type of the column.
+ *
+ * A column may be followed by the distribution of its noise and, in
+ * parentheses, its scale, e.g. 'public.orders.amount laplace(2)'.  The
+ * default is uniform(5).  clamp(bound) after that bounds the column's
+ * values in sums whose result planner mode perturbs.
+ *
+ * When pg_ipm is preloaded, the setting is compiled into a sorted rule
+ * directory in shared memory, and the directory's generation is bumped.
+ * The postmaster stays out of this: the first backend that refreshes its
+ * rules after startup or a reload, and finds the directory compiled from
+ * another setting than its own, compiles and publishes it, unless the
+ * directory is younger than the backend's last reload.  Other backends
+ * never parse the setting.  Their rule hash is filled lazily, one relation
+ * at a time, by binary search in the directory, and discarded when the
+ * generation changes.  A new backend thus pays for the rules its queries
+ * touch, not for all of them.  Without preloading, each backend parses the
+ * setting itself.
+ *
+ * On top of the rule hash sits a cache of resolved relations, which
+ * records for every relation looked up whether, and by which rules, it is
+ * protected, including rules inherited from a partitioned table or
+ * inheritance parent.  It is flushed by relcache invalidations of the
+ * relations it knows about, in particular when partitions are attached,
+ * created, detached or dropped, and refilled lazily.  In steady state a
+ * lookup is a single hash probe without catalog access.
+ *
+ * Copyright 2022 Ernst-Georg Schmid
+ *
+ * Distributed under The PostgreSQL License
+ * see License file for terms
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include <ctype.h>
+
+#include "access/genam.h"
+#include "access/htup_details.h"
+#include "access/table.h"
+#include "miscadmin.h"
+#include "catalog/pg_inherits.h"
+#include "common/hashfn.h"
+#include "nodes/pg_list.h"
+#include "parser/scansup.h"
+#include "port/atomics.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/builtins.h"
+#include "utils/fmgroids.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/plancache.h"
+#include "utils/syscache.h"
+#include "utils/timestamp.h"
+#include "utils/varlena.h"
+#include "utils/wait_event.h"
+
+#include "pg_ipm.h"
+#include "ipm_probes.h"
+
+char	   *ipm_rules = NULL;
+int			ipm_max_rules = 1000;
+
+/*
+ * A single parsed rule.  relid and attnum are set for a relid:attnum pair,
+ * the names for a rule by name.
+ */
+typedef struct IpmRuleSpec
+{
+    Oid         relid;          /* InvalidOid for a rule by name */
+    AttrNumber  attnum;
+    NameData    nspname;
+    NameData    relname;
+    NameData    attname;
+    IpmNoiseSpec noise;
+} IpmRuleSpec;
+
+static const struct
+{
+    const char *name;
+    IpmDistribution dist;
+}			distributions[] = {
+    {"uniform", IPM_DIST_UNIFORM},
+    {"laplace", IPM_DIST_LAPLACE},
+    {"gaussian", IPM_DIST_GAUSSIAN}
+};
+
+/*
+ * The rule directory in shared memory.  specs holds the nnumeric relid:attnum
+ * rules sorted by (relid, attnum), followed by the rules by name sorted by
+ * name, without duplicates.  Writers hold lock, and make generation odd
+ * while they rewrite specs and even again when they are done, so readers
+ * never need the lock: they retry if the generation changed under them.
+ * source_hash identifies the setting the specs were compiled from and
+ * published the time of the publishing backend's last reload; both are
+ * only accessed under lock.
+ */
+typedef struct IpmRuleDirectory
+{
+    pg_atomic_uint64 generation;
+    LWLock	   *lock;
+    uint64		source_hash;
+    TimestampTz published;      /* 0 while nothing has been published */
+    int			nspecs;
+    int			nnumeric;
+    IpmRuleSpec specs[FLEXIBLE_ARRAY_MEMBER];
+} IpmRuleDirectory;
+
+static IpmRuleDirectory *rule_directory = NULL;
+
+#ifdef IPM_HAVE_SHMEM_REQUEST_HOOK
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+/*
+ * Entry of the cache of resolved relations.  rules is NULL if the relation
+ * is not protected.  Otherwise they are the relation's own rules, or those
+ * of its nearest protected ancestor translated to its own attnums.
+ */
+typedef struct IpmResolvedRelation
+{
+    Oid         relid;
+    IpmRelationRules *rules;
+} IpmResolvedRelation;
+
+/*
+ * The backend's rule hash.  It caches negative results too, as entries
+ * without columns.  Without a rule directory, local_specs holds the parsed
+ * setting instead.
+ */
+static HTAB *rule_hash = NULL;
+static MemoryContext rule_context = NULL;
+static uint64 rule_generation = 0;
+static bool rules_stale = false;
+static IpmRuleSpec *local_specs = NULL;
+static int	local_nspecs = 0;
+static int	local_nnumeric = 0;
+
+/*
+ * Relations whose rule hash entries a relcache invalidation has made
+ * stale: their columns may have been renamed, dropped or changed type.
+ * The entries are dropped at the next refresh; too many of them reset
+ * the whole hash.
+ */
+#define MAX_PENDING_RELIDS 64
+static Oid	pending_relids[MAX_PENDING_RELIDS];
+static int	npending_relids = 0;
+static bool rule_hash_stale = false;
+
+static HTAB *resolved_hash = NULL;
+static MemoryContext resolved_context = NULL;
+static bool resolved_stale = false;
+static bool callback_registered = false;
+
+static int	rule_spec_cmp(const void *a, const void *b);
+
+/*
+ * Parse "(number)" at *str into *value, skipping whitespace around it, and
+ * advance *str past it.  Returns false on a syntax error or a number not
+ * in (0, max].
+ */
+static bool
+parse_parenthesized(char **str, float8 *value, float8 max)
+{
+    char	   *end;
+
+    if (**str != '(')
+        return false;
+
+    errno = 0;
+    *value = strtod(*str + 1, &end);
+    if (errno != 0 || end == *str + 1 || !(*value > 0.0 && *value <= max))
+        return false;
+
+    while (scanner_isspace(*end))
+        end++;
+    if (*end != ')')
+        return false;
+    end++;
+    while (scanner_isspace(*end))
+        end++;
+
+    *str = end;
+    return true;
+}
+
+/*
+ * Parse a distribution, with an optional scale in parentheses, and an
+ * optional clamp(bound) into *noise.  Either may be left out.  Returns
+ * false on a syntax error or a number out of range.
+ */
+static bool
+parse_noise_spec(char *str, IpmNoiseSpec *noise)
+{
+    int			i;
+
+    noise->dist = IPM_DIST_UNIFORM;
+    noise->scale = IPM_DEFAULT_SCALE;
+    noise->clamp = 0.0;
+
+    for (i = 0; i < lengthof(distributions); i++)
+    {
+        int			len = strlen(distributions[i].name);
+
+        if (pg_strncasecmp(str, distributions[i].name, len) == 0 &&
+            !isalpha((unsigned char) str[len]))
+        {
+            noise->dist = distributions[i].dist;
+            str += len;
+            while (scanner_isspace(*str))
+                str++;
+            if (*str == '(' &&
+                !parse_parenthesized(&str, &noise->scale, IPM_MAX_SCALE))
+                return false;
+            break;
+        }
+    }
+
+    if (pg_strncasecmp(str, "clamp", 5) == 0 &&
+        !isalpha((unsigned char) str[5]))
+    {
+        str += 5;
+        while (scanner_isspace(*str))
+            str++;
+        if (!parse_parenthesized(&str, &noise->clamp, IPM_MAX_CLAMP))
+            return false;
+    }
+    else if (i == lengthof(distributions))
+        return false;
+
+    return *str == '\0';
+}
+
+/*
+ * Parse one list element.  Returns false on a syntax error.
+ */
+static bool
+parse_rule_spec(char *elem, IpmRuleSpec *spec)
+{
+    char	   *end;
+    unsigned long relid;
+    long		attnum;
+    List	   *names;
+    bool		inquote = false;
+
+    memset(spec, 0, sizeof(IpmRuleSpec));
+    spec->noise.dist = IPM_DIST_UNIFORM;
+    spec->noise.scale = IPM_DEFAULT_SCALE;
+    spec->noise.clamp = 0.0;
+
+    /* split off the noise, after the first space outside quotes */
+    for (end = elem; *end != '\0'; end++)
+    {
+        if (*end == '"')
+            inquote = !inquote;
+        else if (!inquote && scanner_isspace(*end))
+        {
+            *end++ = '\0';
+            while (scanner_isspace(*end))
+                end++;
+            if (!parse_noise_spec(end, &spec->noise))
+                return false;
+            break;
+        }
+    }
+
+    if (isdigit((unsigned char) *elem))
+    {
+        errno = 0;
+        relid = strtoul(elem, &end, 10);
+        if (errno != 0 || end == elem || *end != ':' ||
+            relid == 0 || relid > PG_UINT32_MAX)
+            return false;
+
+        elem = end + 1;
+        attnum = strtol(elem, &end, 10);
+        if (errno != 0 || end == elem || *end != '\0' ||
+            attnum < 1 || attnum > MaxAttrNumber)
+            return false;
+
+        spec->relid = (Oid) relid;
+        spec->attnum = (AttrNumber) attnum;
+        return true;
+    }
+
+    /* schema.table.column, downcased and dequoted like any identifier */
+    if (!SplitIdentifierString(elem, '.', &names) || list_length(names) != 3)
+        return false;
+
+    namestrcpy(&spec->nspname, (char *) linitial(names));
+    namestrcpy(&spec->relname, (char *) lsecond(names));
+    namestrcpy(&spec->attname, (char *) lthird(names));
+    list_free(names);
+    return true;
+}
+
+/*
+ * Split a rules string at the commas outside double quotes.  Leading and
+ * trailing whitespace is removed from the elements, which point into
+ * rawstring.  Returns false if an element is empty or a quote is not
+ * closed.  pg_ipm.policies is split the same way.
+ */
+bool
+ipm_split_rules(char *rawstring, List **elemlist)
+{
+    char	   *p = rawstring;
+
+    *elemlist = NIL;
+
+    while (scanner_isspace(*p))
+        p++;
+    if (*p == '\0')
+        return true;
+
+    for (;;)
+    {
+        char	   *elem;
+        char	   *end;
+        bool		inquote = false;
+
+        while (scanner_isspace(*p))
+            p++;
+        elem = p;
+
+        while (*p != '\0' && (inquote || *p != ','))
+        {
+            if (*p == '"')
+                inquote = !inquote;
+            p++;
+        }
+        if (inquote)
+            return false;
+
+        end = p;
+        while (end > elem && scanner_isspace(end[-1]))
+            end--;
+        if (end == elem)
+            return false;
+
+        *elemlist = lappend(*elemlist, elem);
+
+        if (*p == '\0')
+        {
+            *end = '\0';
+            return true;
+        }
+        *end = '\0';
+        p++;
+    }
+}
+
+/*
+ * Split a rules string into an array of specs allocated in the current
+ * memory context.  On a syntax error the offending element is returned in
+ * *bad and NULL is returned.
+ */
+static IpmRuleSpec *
+parse_rules(const char *value, int *nspecs, char **bad)
+{
+    char	   *rawstring;
+    List	   *elemlist;
+    ListCell   *lc;
+    IpmRuleSpec *specs;
+    int			n = 0;
+
+    *nspecs = 0;
+    *bad = NULL;
+
+    rawstring = pstrdup(value ? value : "");
+    if (!ipm_split_rules(rawstring, &elemlist))
+    {
+        *bad = rawstring;
+        return NULL;
+    }
+
+    specs = (IpmRuleSpec *) palloc(sizeof(IpmRuleSpec) * (list_length(elemlist) + 1));
+
+    foreach(lc, elemlist)
+    {
+        char	   *elem = (char *) lfirst(lc);
+        char	   *copy = pstrdup(elem);
+
+        if (!parse_rule_spec(copy, &specs[n]))
+        {
+            *bad = pstrdup(elem);
+            return NULL;
+        }
+        n++;
+    }
+
+    *nspecs = n;
+    return specs;
+}
+
+/*
+ * GUC check hook for pg_ipm.rules
+ */
+bool
+ipm_check_rules(char **newval, void **extra, GucSource source)
+{
+    IpmRuleSpec *specs;
+    int			nspecs;
+    char	   *bad;
+    int			i;
+
+    specs = parse_rules(*newval, &nspecs, &bad);
+    if (specs == NULL && bad != NULL)
+    {
+        GUC_check_errdetail("Invalid rule \"%s\", expected schema.table.column "
+                            "or relid:attnum, optionally followed by uniform, "
+                            "laplace or gaussian and a scale in parentheses, "
+                            "and by clamp and a bound in parentheses.",
+                            bad);
+        return false;
+    }
+
+    if (nspecs > ipm_max_rules)
+    {
+        GUC_check_errdetail("%d rules exceed pg_ipm.max_rules (%d).",
+                            nspecs, ipm_max_rules);
+        return false;
+    }
+
+    /* a column listed twice must have the same noise both times */
+    if (nspecs > 1)
+        qsort(specs, nspecs, sizeof(IpmRuleSpec), rule_spec_cmp);
+    for (i = 1; i < nspecs; i++)
+    {
+        if (rule_spec_cmp(&specs[i - 1], &specs[i]) == 0 &&
+            (specs[i - 1].noise.dist != specs[i].noise.dist ||
+             specs[i - 1].noise.scale != specs[i].noise.scale ||
+             specs[i - 1].noise.clamp != specs[i].noise.clamp))
+        {
+            GUC_check_errdetail("A column is listed twice with different noise.");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * The sort order of the rule directory: relid:attnum rules by relid and
+ * attnum, then rules by name by name.
+ */
+static int
+rule_spec_cmp(const void *a, const void *b)
+{
+    const IpmRuleSpec *sa = (const IpmRuleSpec *) a;
+    const IpmRuleSpec *sb = (const IpmRuleSpec *) b;
+    int			cmp;
+
+    if (OidIsValid(sa->relid) != OidIsValid(sb->relid))
+        return OidIsValid(sa->relid) ? -1 : 1;
+
+    if (OidIsValid(sa->relid))
+    {
+        if (sa->relid != sb->relid)
+            return (sa->relid < sb->relid) ? -1 : 1;
+        if (sa->attnum != sb->attnum)
+            return (sa->attnum < sb->attnum) ? -1 : 1;
+        return 0;
+    }
+
+    cmp = strcmp(NameStr(sa->nspname), NameStr(sb->nspname));
+    if (cmp == 0)
+        cmp = strcmp(NameStr(sa->relname), NameStr(sb->relname));
+    if (cmp == 0)
+        cmp = strcmp(NameStr(sa->attname), NameStr(sb->attname));
+    return cmp;
+}
+
+/*
+ * Parse a setting into a sorted, duplicate free spec array.  *nnumeric is
+ * set to the number of relid:attnum rules at its start.  The check hook
+ * has already rejected malformed settings.
+ */
+static IpmRuleSpec *
+compile_rules(const char *value, int *nspecs, int *nnumeric)
+{
+    IpmRuleSpec *specs;
+    char	   *bad;
+    int			n;
+    int			i;
+    int			j;
+
+    specs = parse_rules(value, &n, &bad);
+    if (specs == NULL)
+        n = 0;
+
+    if (n > 1)
+    {
+        qsort(specs, n, sizeof(IpmRuleSpec), rule_spec_cmp);
+
+        for (i = 1, j = 0; i < n; i++)
+        {
+            if (rule_spec_cmp(&specs[i], &specs[j]) != 0)
+                specs[++j] = specs[i];
+        }
+        n = j + 1;
+    }
+
+    for (i = 0; i < n && OidIsValid(specs[i].relid); i++)
+        ;
+
+    *nspecs = n;
+    *nnumeric = i;
+    return specs;
+}
+
+/*
+ * Should the backend's setting, with hash source_hash, replace the
+ * directory?  Not if the directory was compiled from the same setting, or
+ * published after the backend last read the configuration, in which case
+ * the backend's setting is the older one.  The caller holds the lock.
+ */
+static inline bool
+directory_outdated(uint64 source_hash)
+{
+    return rule_directory->published == 0 ||
+        (rule_directory->source_hash != source_hash &&
+         rule_directory->published < PgReloadTime);
+}
+
+/*
+ * Publish the backend's setting in the shared directory if it is newer
+ * than the one the directory was compiled from.  Other backends notice the
+ * new generation at their next refresh.
+ */
+static void
+publish_rules(void)
+{
+    const char *value = ipm_rules ? ipm_rules : "";
+    uint64		source_hash;
+    IpmRuleSpec *specs;
+    int			nspecs;
+    int			nnumeric;
+
+    source_hash = hash_bytes_extended((const unsigned char *) value,
+                                      strlen(value), 0);
+
+    LWLockAcquire(rule_directory->lock, LW_SHARED);
+    if (!directory_outdated(source_hash))
+    {
+        LWLockRelease(rule_directory->lock);
+        return;
+    }
+    LWLockRelease(rule_directory->lock);
+
+    /* compile before taking the lock exclusively, this may fail */
+    specs = compile_rules(value, &nspecs, &nnumeric);
+
+    /* the check hook has enforced the limit, but be safe */
+    nspecs = Min(nspecs, ipm_max_rules);
+    nnumeric = Min(nnumeric, nspecs);
+
+    LWLockAcquire(rule_directory->lock, LW_EXCLUSIVE);
+    if (directory_outdated(source_hash))
+    {
+        pg_atomic_fetch_add_u64(&rule_directory->generation, 1);
+        pg_write_barrier();
+        if (nspecs > 0)
+            memcpy(rule_directory->specs, specs, sizeof(IpmRuleSpec) * nspecs);
+        rule_directory->nspecs = nspecs;
+        rule_directory->nnumeric = nnumeric;
+        pg_write_barrier();
+        pg_atomic_fetch_add_u64(&rule_directory->generation, 1);
+
+        rule_directory->source_hash = source_hash;
+        rule_directory->published = Max(PgReloadTime, 1);
+    }
+    LWLockRelease(rule_directory->lock);
+
+    if (specs != NULL)
+        pfree(specs);
+}
+
+/*
+ * GUC assign hook for pg_ipm.rules.  Assign hooks must not fail, so
+ * backends only note the change here and recompile, or publish the
+ * directory anew, on the next refresh.  Plans compiled by the planner mode
+ * embed the old rules.
+ */
+void
+ipm_assign_rules(const char *newval, void *extra)
+{
+    rules_stale = true;
+
+    if (ipm_mode == IPM_MODE_PLANNER)
+        ResetPlanCache();
+}
+
+static Size
+rule_directory_size(void)
+{
+    return add_size(offsetof(IpmRuleDirectory, specs),
+                    mul_size(sizeof(IpmRuleSpec), ipm_max_rules));
+}
+
+static void
+ipm_rules_shmem_request(void)
+{
+#ifdef IPM_HAVE_SHMEM_REQUEST_HOOK
+    if (prev_shmem_request_hook)
+        prev_shmem_request_hook();
+#endif
+
+    RequestAddinShmemSpace(rule_directory_size());
+    RequestNamedLWLockTranche("pg_ipm rules", 1);
+}
+
+static void
+ipm_rules_shmem_startup(void)
+{
+    bool		found;
+
+    if (prev_shmem_startup_hook)
+        prev_shmem_startup_hook();
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+    rule_directory = (IpmRuleDirectory *) ShmemInitStruct("pg_ipm rule directory",
+                                                          rule_directory_size(),
+                                                          &found);
+    if (!found)
+    {
+        pg_atomic_init_u64(&rule_directory->generation, 0);
+        rule_directory->lock = &(GetNamedLWLockTranche("pg_ipm rules"))->lock;
+        rule_directory->source_hash = 0;
+        rule_directory->published = 0;
+        rule_directory->nspecs = 0;
+        rule_directory->nnumeric = 0;
+    }
+
+    LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Set up the shared rule directory.  Must be called from _PG_init, after
+ * the GUCs are defined.
+ */
+void
+ipm_rules_init(void)
+{
+    if (!process_shared_preload_libraries_in_progress)
+        return;
+
+#ifdef IPM_HAVE_SHMEM_REQUEST_HOOK
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = ipm_rules_shmem_request;
+#else
+    ipm_rules_shmem_request();
+#endif
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = ipm_rules_shmem_startup;
+}
+
+void
+ipm_rules_fini(void)
+{
+    if (!process_shared_preload_libraries_in_progress)
+        return;
+
+#ifdef IPM_HAVE_SHMEM_REQUEST_HOOK
+    shmem_request_hook = prev_shmem_request_hook;
+#endif
+    shmem_startup_hook = prev_shmem_startup_hook;
+}
+
+/*
+ * Have the rules changed since the rule hash was reset?
+ */
+static inline bool
+rules_changed(void)
+{
+    if (rule_directory != NULL)
+        return pg_atomic_read_u64(&rule_directory->generation) != rule_generation;
+
+    return rules_stale;
+}
+
+/*
+ * Discard the rule hash, and with it all resolved relations, which point
+ * into it.
+ */
+static void
+reset_rule_hash(void)
+{
+    HASHCTL		ctl;
+
+    if (rule_context != NULL)
+    {
+        MemoryContextDelete(rule_context);
+        resolved_stale = true;
+        ipm_memo_reset();
+    }
+
+    rule_context = AllocSetContextCreate(TopMemoryContext,
+                                         "pg_ipm rules",
+                                         ALLOCSET_SMALL_SIZES);
+
+    memset(&ctl, 0, sizeof(ctl));
+    ctl.keysize = sizeof(Oid);
+    ctl.entrysize = sizeof(IpmRelationRules);
+    ctl.hcxt = rule_context;
+    rule_hash = hash_create("pg_ipm rule hash", 64, &ctl,
+                            HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+    if (rule_directory != NULL)
+        rule_generation = pg_atomic_read_u64(&rule_directory->generation);
+    else
+    {
+        MemoryContext oldcontext = MemoryContextSwitchTo(rule_context);
+
+        local_specs = compile_rules(ipm_rules, &local_nspecs, &local_nnumeric);
+        MemoryContextSwitchTo(oldcontext);
+    }
+    rules_stale = false;
+    rule_hash_stale = false;
+    npending_relids = 0;
+}
+
+/*
+ * Copy the rules for relation relid, whose schema and name are nspname and
+ * relname, out of the sorted spec array specs into *matches.  The array
+ * may be the shared directory while a backend rewrites it, so indexes
+ * are clamped and the result is only trusted once the caller has checked
+ * the generation.
+ */
+static int
+copy_matching_specs(const IpmRuleSpec *specs, int nspecs, int nnumeric,
+                    Oid relid, const char *nspname, const char *relname,
+                    IpmRuleSpec **matches)
+{
+    int			lo = 0;
+    int			hi = nnumeric;
+    int			numstart;
+    int			numend;
+    int			namestart;
+    int			nameend;
+
+    while (lo < hi)
+    {
+        int			mid = (lo + hi) / 2;
+
+        if (specs[mid].relid < relid)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    numstart = lo;
+    for (numend = numstart; numend < nnumeric && specs[numend].relid == relid; numend++)
+        ;
+
+    namestart = nameend = nnumeric;
+    if (nspname != NULL && relname != NULL)
+    {
+        lo = nnumeric;
+        hi = nspecs;
+        while (lo < hi)
+        {
+            int			mid = (lo + hi) / 2;
+            int			cmp = strcmp(NameStr(specs[mid].nspname), nspname);
+
+            if (cmp == 0)
+                cmp = strcmp(NameStr(specs[mid].relname), relname);
+            if (cmp < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        namestart = lo;
+        for (nameend = namestart;
+             nameend < nspecs &&
+             strcmp(NameStr(specs[nameend].nspname), nspname) == 0 &&
+             strcmp(NameStr(specs[nameend].relname), relname) == 0;
+             nameend++)
+            ;
+    }
+
+    *matches = (IpmRuleSpec *) palloc(sizeof(IpmRuleSpec) *
+                                      Max(numend - numstart + nameend - namestart, 1));
+    memcpy(*matches, specs + numstart, sizeof(IpmRuleSpec) * (numend - numstart));
+    memcpy(*matches + (numend - numstart), specs + namestart,
+           sizeof(IpmRuleSpec) * (nameend - namestart));
+
+    return numend - numstart + nameend - namestart;
+}
+
+/*
+ * Resolve one rule of relation relid to its column.  Returns false if the
+ * column has been dropped.
+ */
+static bool
+resolve_column(Oid relid, const IpmRuleSpec *spec, IpmColumnRule *column)
+{
+    HeapTuple	tuple;
+    Form_pg_attribute attr;
+
+    if (OidIsValid(spec->relid))
+        tuple = SearchSysCache2(ATTNUM, ObjectIdGetDatum(relid),
+                                Int16GetDatum(spec->attnum));
+    else
+        tuple = SearchSysCacheAttName(relid, NameStr(spec->attname));
+
+    if (!HeapTupleIsValid(tuple))
+    {
+        if (OidIsValid(spec->relid))
+            ereport(ERROR,
+                    (errcode(ERRCODE_UNDEFINED_COLUMN),
+                     errmsg("pg_ipm rule for relation %u refers to nonexistent column %d",
+                            relid, spec->attnum)));
+        else
+            ereport(ERROR,
+                    (errcode(ERRCODE_UNDEFINED_COLUMN),
+                     errmsg("pg_ipm rule refers to nonexistent column \"%s\" of relation \"%s.%s\"",
+                            NameStr(spec->attname), NameStr(spec->nspname),
+                            NameStr(spec->relname)),
+                     errhint("Update pg_ipm.rules after renaming or dropping a protected column.")));
+    }
+
+    attr = (Form_pg_attribute) GETSTRUCT(tuple);
+    if (attr->attisdropped)
+    {
+        ReleaseSysCache(tuple);
+        return false;
+    }
+
+    column->attnum = attr->attnum;
+    column->typid = getBaseType(attr->atttypid);
+    column->typlen = attr->attlen;
+    column->typbyval = attr->attbyval;
+    column->owner = relid;
+    column->ident = attr->attnum;
+    column->noise = spec->noise;
+    ReleaseSysCache(tuple);
+
+    return true;
+}
+
+static int
+column_rule_cmp(const void *a, const void *b)
+{
+    AttrNumber  aa = ((const IpmColumnRule *) a)->attnum;
+    AttrNumber  ab = ((const IpmColumnRule *) b)->attnum;
+
+    return (aa > ab) - (aa < ab);
+}
+
+/*
+ * Collect and resolve the rules of relation relid from the directory or
+ * the local specs.  Returns the number of columns, which are palloc'd in
+ * the current memory context.
+ */
+static int
+load_rules(Oid relid, IpmColumnRule **columns)
+{
+    IpmRuleSpec *matches = NULL;
+    int			nmatches;
+    char	   *relname;
+    char	   *nspname = NULL;
+    int			n = 0;
+    int			i;
+
+    /* by name rules need the name of the relation */
+    relname = get_rel_name(relid);
+    if (relname != NULL)
+        nspname = get_namespace_name(get_rel_namespace(relid));
+
+    if (rule_directory == NULL)
+        nmatches = copy_matching_specs(local_specs, local_nspecs, local_nnumeric,
+                                       relid, nspname, relname, &matches);
+    else
+    {
+        bool		waiting = false;
+
+        for (;;)
+        {
+            uint64		generation = pg_atomic_read_u64(&rule_directory->generation);
+
+            if ((generation & 1) == 0)
+            {
+                int			nspecs;
+
+                pg_read_barrier();
+                nspecs = Min(rule_directory->nspecs, ipm_max_rules);
+                nmatches = copy_matching_specs(rule_directory->specs, nspecs,
+                                               Min(rule_directory->nnumeric, nspecs),
+                                               relid, nspname, relname, &matches);
+                pg_read_barrier();
+                if (pg_atomic_read_u64(&rule_directory->generation) == generation)
+                    break;
+                pfree(matches);
+            }
+
+            /* errors end the wait with the transaction */
+            if (!waiting)
+            {
+                pgstat_report_wait_start(ipm_wait_event);
+                waiting = true;
+            }
+            pg_spin_delay();
+        }
+        if (waiting)
+            pgstat_report_wait_end();
+    }
+
+    *columns = (IpmColumnRule *) palloc(sizeof(IpmColumnRule) * Max(nmatches, 1));
+    for (i = 0; i < nmatches; i++)
+    {
+        if (resolve_column(relid, &matches[i], &(*columns)[n]))
+            n++;
+    }
+    pfree(matches);
+
+    /* a column may be named both ways */
+    if (n > 1)
+    {
+        int			j;
+
+        qsort(*columns, n, sizeof(IpmColumnRule), column_rule_cmp);
+        for (i = 1, j = 0; i < n; i++)
+        {
+            if ((*columns)[i].attnum != (*columns)[j].attnum)
+                (*columns)[++j] = (*columns)[i];
+        }
+        n = j + 1;
+    }
+
+    return n;
+}
+
+/*
+ * Return the rules configured for relation relid, or NULL if there are
+ * none.  The columns are resolved on the first lookup of the relation and
+ * kept until a relcache invalidation of the relation.
+ */
+static IpmRelationRules *
+lookup_rules(Oid relid)
+{
+    IpmRelationRules *entry;
+    IpmColumnRule *columns;
+    int			ncolumns;
+
+    Assert(rule_hash != NULL);
+
+    if (!OidIsValid(relid))
+        return NULL;
+
+    entry = (IpmRelationRules *) hash_search(rule_hash, &relid, HASH_FIND, NULL);
+    if (entry != NULL)
+        return (entry->ncolumns > 0) ? entry : NULL;
+
+    /*
+     * Resolving may fail or run invalidation callbacks, so the entry is only
+     * made when it is done.
+     */
+    ncolumns = load_rules(relid, &columns);
+
+    entry = (IpmRelationRules *) hash_search(rule_hash, &relid, HASH_ENTER, NULL);
+    entry->ncolumns = ncolumns;
+    entry->columns = NULL;
+    if (ncolumns > 0)
+    {
+        entry->columns = (IpmColumnRule *) MemoryContextAlloc(rule_context,
+                                                              sizeof(IpmColumnRule) * ncolumns);
+        memcpy(entry->columns, columns, sizeof(IpmColumnRule) * ncolumns);
+    }
+    pfree(columns);
+
+    return (entry->ncolumns > 0) ? entry : NULL;
+}
+
+/*
+ * Return the rule of column attnum, or NULL if rules do not protect it.
+ */
+IpmColumnRule *
+ipm_find_rule_column(IpmRelationRules *rules, AttrNumber attnum)
+{
+    int         lo = 0;
+    int         hi = rules->ncolumns - 1;
+
+    while (lo <= hi)
+    {
+        int         mid = (lo + hi) / 2;
+        AttrNumber  midattnum = rules->columns[mid].attnum;
+
+        if (midattnum == attnum)
+            return &rules->columns[mid];
+        if (midattnum < attnum)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+
+    return NULL;
+}
+
+/*
+ * Relcache invalidation callback.  Rule hash entries of the relation are
+ * dropped at the next refresh, so that its columns are resolved anew.
+ * Relations not in the cache of resolved relations cannot affect it: a
+ * new partition or child always invalidates its parent as well.  Dropping
+ * a relation that is not protected only forgets about it; any change to a
+ * protected relation flushes the cache, because it may have moved within
+ * an inheritance tree.
+ */
+static void
+rules_relcache_callback(Datum arg, Oid relid)
+{
+    IpmResolvedRelation *entry;
+
+    if (!OidIsValid(relid))
+    {
+        rule_hash_stale = true;
+        resolved_stale = true;
+        return;
+    }
+
+    if (rule_hash != NULL && !rule_hash_stale &&
+        hash_search(rule_hash, &relid, HASH_FIND, NULL) != NULL)
+    {
+        if (npending_relids < MAX_PENDING_RELIDS)
+            pending_relids[npending_relids++] = relid;
+        else
+            rule_hash_stale = true;
+    }
+
+    if (resolved_hash == NULL)
+        return;
+
+    entry = (IpmResolvedRelation *) hash_search(resolved_hash, &relid,
+                                                HASH_FIND, NULL);
+    if (entry == NULL)
+        return;
+
+    if (entry->rules == NULL)
+        (void) hash_search(resolved_hash, &relid, HASH_REMOVE, NULL);
+    else
+        resolved_stale = true;
+}
+
+static void
+reset_resolved_hash(void)
+{
+    HASHCTL		ctl;
+
+    resolved_stale = false;
+
+    if (resolved_context != NULL)
+        MemoryContextDelete(resolved_context);
+
+    resolved_context = AllocSetContextCreate(TopMemoryContext,
+                                             "pg_ipm resolved relations",
+                                             ALLOCSET_DEFAULT_SIZES);
+
+    memset(&ctl, 0, sizeof(ctl));
+    ctl.keysize = sizeof(Oid);
+    ctl.entrysize = sizeof(IpmResolvedRelation);
+    ctl.hcxt = resolved_context;
+    resolved_hash = hash_create("pg_ipm resolved relations", 256, &ctl,
+                                HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+    if (!callback_registered)
+    {
+        CacheRegisterRelcacheCallback(rules_relcache_callback, (Datum) 0);
+        callback_registered = true;
+    }
+}
+
+/*
+ * Translate the rules of relation owner to the attnums of its descendant
+ * relid, matching columns by name.  Partitions and inheritance children can
+ * number their columns differently from their parent, e.g. after columns
+ * were dropped from either.
+ */
+static IpmRelationRules *
+translate_rules(IpmRelationRules *rules, Oid owner, Oid relid)
+{
+    IpmRelationRules *copy;
+    int			i;
+    int			n = 0;
+
+    copy = (IpmRelationRules *) MemoryContextAlloc(resolved_context,
+                                                   sizeof(IpmRelationRules));
+    copy->relid = relid;
+    copy->columns = (IpmColumnRule *) MemoryContextAlloc(resolved_context,
+                                                         sizeof(IpmColumnRule) * rules->ncolumns);
+
+    for (i = 0; i < rules->ncolumns; i++)
+    {
+        char	   *attname = get_attname(owner, rules->columns[i].attnum, true);
+        AttrNumber	attnum;
+
+        if (attname == NULL)
+            continue;
+
+        attnum = get_attnum(relid, attname);
+        if (attnum != InvalidAttrNumber)
+        {
+            copy->columns[n] = rules->columns[i];
+            copy->columns[n].attnum = attnum;
+            n++;
+        }
+    }
+
+    if (n > 1)
+        qsort(copy->columns, n, sizeof(IpmColumnRule), column_rule_cmp);
+    copy->ncolumns = n;
+
+    return copy;
+}
+
+/*
+ * Combine the rules a and b of the same relation.  Where both protect a
+ * column, the rule of a wins.  The result may be a or b itself.
+ */
+static IpmRelationRules *
+merge_rules(IpmRelationRules *a, IpmRelationRules *b)
+{
+    IpmRelationRules *merged;
+    int			i;
+    int			n;
+
+    if (a == NULL || a->ncolumns == 0)
+        return b;
+    if (b == NULL || b->ncolumns == 0)
+        return a;
+
+    merged = (IpmRelationRules *) MemoryContextAlloc(resolved_context,
+                                                     sizeof(IpmRelationRules));
+    merged->relid = a->relid;
+    merged->columns = (IpmColumnRule *)
+        MemoryContextAlloc(resolved_context,
+                           sizeof(IpmColumnRule) * (a->ncolumns + b->ncolumns));
+    memcpy(merged->columns, a->columns, sizeof(IpmColumnRule) * a->ncolumns);
+    n = a->ncolumns;
+
+    for (i = 0; i < b->ncolumns; i++)
+    {
+        if (ipm_find_rule_column(a, b->columns[i].attnum) == NULL)
+            merged->columns[n++] = b->columns[i];
+    }
+
+    if (n == a->ncolumns)
+    {
+        pfree(merged->columns);
+        pfree(merged);
+        return a;
+    }
+
+    qsort(merged->columns, n, sizeof(IpmColumnRule), column_rule_cmp);
+    merged->ncolumns = n;
+
+    return merged;
+}
+
+/*
+ * The direct parents of relid in pg_inherits, in inhseqno order.
+ */
+static List *
+find_parents(Oid relid)
+{
+    Relation	rel;
+    ScanKeyData key;
+    SysScanDesc scan;
+    HeapTuple	tuple;
+    List	   *parents = NIL;
+
+    rel = table_open(InheritsRelationId, AccessShareLock);
+
+    ScanKeyInit(&key,
+                Anum_pg_inherits_inhrelid,
+                BTEqualStrategyNumber, F_OIDEQ,
+                ObjectIdGetDatum(relid));
+    scan = systable_beginscan(rel, InheritsRelidSeqnoIndexId, true,
+                              NULL, 1, &key);
+
+    while (HeapTupleIsValid(tuple = systable_getnext(scan)))
+        parents = lappend_oid(parents,
+                              ((Form_pg_inherits) GETSTRUCT(tuple))->inhparent);
+
+    systable_endscan(scan);
+    table_close(rel, AccessShareLock);
+
+    return parents;
+}
+
+/*
+ * Enter all descendants of the protected relation owner into the cache at
+ * once, so a parent with thousands of partitions costs one pg_inherits
+ * scan instead of one per partition.  rules are the rules that apply to
+ * owner itself.  If a descendant has rules of its own, or more than one
+ * parent, its rules are not just those of owner; the descendants are then
+ * left to be resolved one by one.
+ */
+static void
+resolve_descendants(Oid owner, IpmRelationRules *rules)
+{
+    List	   *children;
+    List	   *numparents;
+    ListCell   *lc;
+    ListCell   *lp;
+
+    if (!has_subclass(owner))
+        return;
+
+    children = find_all_inheritors(owner, NoLock, &numparents);
+
+    forboth(lc, children, lp, numparents)
+    {
+        Oid			child = lfirst_oid(lc);
+
+        if (child != owner &&
+            (lfirst_int(lp) > 1 || lookup_rules(child) != NULL))
+        {
+            list_free(children);
+            list_free(numparents);
+            return;
+        }
+    }
+
+    foreach(lc, children)
+    {
+        Oid			child = lfirst_oid(lc);
+        IpmRelationRules *translated;
+        IpmResolvedRelation *entry;
+
+        if (child == owner ||
+            hash_search(resolved_hash, &child, HASH_FIND, NULL) != NULL)
+            continue;
+
+        translated = translate_rules(rules, owner, child);
+        entry = (IpmResolvedRelation *) hash_search(resolved_hash, &child,
+                                                    HASH_ENTER, NULL);
+        entry->rules = translated;
+    }
+
+    list_free(children);
+    list_free(numparents);
+}
+
+/*
+ * Bring the caches up to date with the rule directory and with relcache
+ * invalidations received so far.  Rules returned by the lookup functions
+ * stay valid until the next call, so this is only done where a query
+ * starts to use them: at the start of planning and of execution.
+ */
+void
+ipm_rules_refresh(void)
+{
+    int			i;
+
+    if (rule_directory != NULL && (rule_hash == NULL || rules_stale))
+    {
+        publish_rules();
+        rules_stale = false;
+    }
+
+    if (rule_hash == NULL || rule_hash_stale || rules_changed())
+        reset_rule_hash();
+
+    /*
+     * Resolved relations point to, or were translated from, the rules
+     * configured for a relation, so dropping those flushes them too.
+     */
+    for (i = 0; i < npending_relids; i++)
+    {
+        IpmRelationRules *entry;
+
+        entry = (IpmRelationRules *) hash_search(rule_hash, &pending_relids[i],
+                                                 HASH_FIND, NULL);
+        if (entry == NULL)
+            continue;
+        if (entry->ncolumns > 0)
+        {
+            pfree(entry->columns);
+            resolved_stale = true;
+        }
+        (void) hash_search(rule_hash, &pending_relids[i], HASH_REMOVE, NULL);
+    }
+    npending_relids = 0;
+
+    if (resolved_hash == NULL || resolved_stale)
+        reset_resolved_hash();
+}
+
+/*
+ * Return the rules that apply to relation relid, in its own attnums: its
+ * own rules together with those that apply to its parents, recursively.
+ * A column's own rule wins over an inherited one, and the rule of an
+ * earlier parent over that of a later one.  Returns NULL if the relation
+ * is not protected.
+ */
+IpmRelationRules *
+ipm_lookup_inherited_rules(Oid relid)
+{
+    IpmResolvedRelation *entry;
+    IpmRelationRules *rules;
+    List	   *parents;
+    ListCell   *lc;
+
+    if (!OidIsValid(relid))
+        return NULL;
+
+    if (resolved_hash == NULL)
+        ipm_rules_refresh();
+
+    entry = (IpmResolvedRelation *) hash_search(resolved_hash, &relid,
+                                                HASH_FIND, NULL);
+    if (entry != NULL)
+        return entry->rules;
+
+    /*
+     * Cache miss.  The catalog lookups below may run invalidation
+     * callbacks, so the entry is only made once they are done.
+     */
+    IPM_TRACE_RULE_CACHE_MISS(relid);
+    rules = lookup_rules(relid);
+
+    parents = find_parents(relid);
+    foreach(lc, parents)
+    {
+        Oid			parent = lfirst_oid(lc);
+        IpmRelationRules *inherited = ipm_lookup_inherited_rules(parent);
+
+        if (inherited != NULL)
+            rules = merge_rules(rules, translate_rules(inherited, parent, relid));
+    }
+    list_free(parents);
+
+    if (rules != NULL && rules->ncolumns == 0)
+        rules = NULL;
+    if (rules != NULL)
+        resolve_descendants(relid, rules);
+
+    entry = (IpmResolvedRelation *) hash_search(resolved_hash, &relid,
+                                                HASH_ENTER, NULL);
+    entry->rules = rules;
+
+    return rules;
+}
@@ -0,0 +1,312 @@
+/*-------------------------------------------------------------------------
+ *
+ * ipm_stats.c
+ *
+ * Activity counters behind the pg_stat_ipm view.
+ *
+ * The executor mode counts into ipm_stats, a plain struct in backend
+ * local memory, so counting costs an increment.  At the end of every
+ * transaction the counts are added to the backend's slot of an array in
+ * shared memory and cleared.  Each slot has a single writer and is only
+ * summed by readers, so there is no contention; the slots are atomics so
+ * that a reset can clear them from another backend.  The time spent
+ * perturbing is measured for one in IPM_TIMING_INTERVAL tuples or batches
+ * only and extrapolated, which keeps the clock off the per-tuple path.
+ *
+ * Backends report ipm_wait_event while they wait for a writer of the rule
+ * directory, so that it shows in pg_stat_activity: the custom wait event
+ * IpmRuleDirectory on PostgreSQL 17 and later, Extension before.
+ *
+ * Copyright 2022 Ernst-Georg Schmid
+ *
+ * Distributed under The PostgreSQL License
+ * see License file for terms
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "postmaster/autovacuum.h"
+#include "replication/walsender.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/timestamp.h"
+#include "utils/wait_event.h"
+
+#include "pg_ipm.h"
+
+PG_FUNCTION_INFO_V1(pg_stat_ipm);
+PG_FUNCTION_INFO_V1(pg_stat_ipm_reset);
+
+IpmStats	ipm_stats;
+
+uint32		ipm_wait_event = WAIT_EVENT_EXTENSION;
+
+#define IPM_STATS_NCOUNTERS (sizeof(IpmStats) / sizeof(uint64))
+
+typedef struct IpmStatsSlot
+{
+    pg_atomic_uint64 counters[IPM_STATS_NCOUNTERS];
+} IpmStatsSlot;
+
+typedef struct IpmStatsArray
+{
+    pg_atomic_uint64 reset_time;    /* TimestampTz of the last reset */
+    int			nslots;
+    IpmStatsSlot slots[FLEXIBLE_ARRAY_MEMBER];
+} IpmStatsArray;
+
+static IpmStatsArray *stats_array = NULL;
+
+#ifdef IPM_HAVE_SHMEM_REQUEST_HOOK
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+/*
+ * The number of backend slots.  PostgreSQL 14 computes MaxBackends only
+ * after the libraries are preloaded, so it is computed the same way here.
+ */
+static int
+max_backends(void)
+{
+#if PG_VERSION_NUM >= 150000
+    return MaxBackends;
+#else
+    return MaxConnections + autovacuum_max_workers + 1 +
+        max_worker_processes + max_wal_senders;
+#endif
+}
+
+static Size
+stats_array_size(void)
+{
+    return add_size(offsetof(IpmStatsArray, slots),
+                    mul_size(sizeof(IpmStatsSlot), max_backends()));
+}
+
+static void
+ipm_stats_shmem_request(void)
+{
+#ifdef IPM_HAVE_SHMEM_REQUEST_HOOK
+    if (prev_shmem_request_hook)
+        prev_shmem_request_hook();
+#endif
+
+    RequestAddinShmemSpace(stats_array_size());
+}
+
+static void
+ipm_stats_shmem_startup(void)
+{
+    bool		found;
+
+    if (prev_shmem_startup_hook)
+        prev_shmem_startup_hook();
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+    stats_array = (IpmStatsArray *) ShmemInitStruct("pg_ipm statistics",
+                                                    stats_array_size(),
+                                                    &found);
+    if (!found)
+    {
+        int			i;
+        int			j;
+
+        pg_atomic_init_u64(&stats_array->reset_time, (uint64) GetCurrentTimestamp());
+        stats_array->nslots = max_backends();
+        for (i = 0; i < stats_array->nslots; i++)
+        {
+            for (j = 0; j < IPM_STATS_NCOUNTERS; j++)
+                pg_atomic_init_u64(&stats_array->slots[i].counters[j], 0);
+        }
+    }
+
+    LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Register the wait event.  Needs shared memory, so it is done at the
+ * first query rather than in _PG_init.
+ */
+void
+ipm_wait_event_init(void)
+{
+#ifdef IPM_HAVE_CUSTOM_WAIT_EVENTS
+    static bool initialized = false;
+
+    if (initialized)
+        return;
+
+    ipm_wait_event = WaitEventExtensionNew("IpmRuleDirectory");
+    initialized = true;
+#endif
+}
+
+/*
+ * Add the local counts to the backend's slot and clear them.
+ */
+static void
+flush_stats(void)
+{
+    uint64	   *local = (uint64 *) &ipm_stats;
+    IpmStatsSlot *slot;
+    int			index = IPM_MY_BACKEND_INDEX();
+    int			i;
+
+    if (stats_array == NULL || index < 0 || index >= stats_array->nslots)
+        return;
+
+    slot = &stats_array->slots[index];
+    for (i = 0; i < IPM_STATS_NCOUNTERS; i++)
+    {
+        if (local[i] != 0)
+            pg_atomic_fetch_add_u64(&slot->counters[i], local[i]);
+    }
+
+    memset(&ipm_stats, 0, sizeof(ipm_stats));
+}
+
+static void
+ipm_stats_xact_callback(XactEvent event, void *arg)
+{
+    switch (event)
+    {
+        case XACT_EVENT_COMMIT:
+        case XACT_EVENT_PARALLEL_COMMIT:
+        case XACT_EVENT_ABORT:
+        case XACT_EVENT_PARALLEL_ABORT:
+        case XACT_EVENT_PREPARE:
+            if (ipm_stats.tuples_inspected != 0 ||
+                ipm_stats.memo_hits != 0 || ipm_stats.memo_misses != 0 ||
+                ipm_stats.queries_bypassed != 0 ||
+                ipm_stats.queries_perturbed != 0)
+                flush_stats();
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * Set up the shared counters.  Must be called from _PG_init.
+ */
+void
+ipm_stats_init(void)
+{
+    RegisterXactCallback(ipm_stats_xact_callback, NULL);
+
+    if (!process_shared_preload_libraries_in_progress)
+        return;
+
+#ifdef IPM_HAVE_SHMEM_REQUEST_HOOK
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = ipm_stats_shmem_request;
+#else
+    ipm_stats_shmem_request();
+#endif
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = ipm_stats_shmem_startup;
+}
+
+void
+ipm_stats_fini(void)
+{
+    UnregisterXactCallback(ipm_stats_xact_callback, NULL);
+
+    if (!process_shared_preload_libraries_in_progress)
+        return;
+
+#ifdef IPM_HAVE_SHMEM_REQUEST_HOOK
+    shmem_request_hook = prev_shmem_request_hook;
+#endif
+    shmem_startup_hook = prev_shmem_startup_hook;
+}
+
+static void
+check_stats_array(void)
+{
+    if (stats_array == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pg_ipm statistics require pg_ipm in shared_preload_libraries")));
+}
+
+/*
+ * pg_stat_ipm() returns record
+ *
+ * The counters summed over all backends, as of their last transaction
+ * end.  perturb_time is in milliseconds.
+ */
+Datum
+pg_stat_ipm(PG_FUNCTION_ARGS)
+{
+    TupleDesc	tupdesc;
+    Datum		values[IPM_STATS_NCOUNTERS + 1];
+    bool		nulls[IPM_STATS_NCOUNTERS + 1];
+    uint64		sums[IPM_STATS_NCOUNTERS];
+    int			i;
+    int			j;
+
+    check_stats_array();
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
+
+    memset(sums, 0, sizeof(sums));
+    for (i = 0; i < stats_array->nslots; i++)
+    {
+        for (j = 0; j < IPM_STATS_NCOUNTERS; j++)
+            sums[j] += pg_atomic_read_u64(&stats_array->slots[i].counters[j]);
+    }
+
+    memset(nulls, 0, sizeof(nulls));
+    i = 0;
+    values[i++] = Int64GetDatum((int64) sums[offsetof(IpmStats, queries_bypassed) / sizeof(uint64)]);
+    values[i++] = Int64GetDatum((int64) sums[offsetof(IpmStats, queries_perturbed) / sizeof(uint64)]);
+    values[i++] = Int64GetDatum((int64) sums[offsetof(IpmStats, tuples_inspected) / sizeof(uint64)]);
+    values[i++] = Int64GetDatum((int64) sums[offsetof(IpmStats, tuples_perturbed) / sizeof(uint64)]);
+    values[i++] = Int64GetDatum((int64) sums[offsetof(IpmStats, nulls_skipped) / sizeof(uint64)]);
+    values[i++] = Float8GetDatum(sums[offsetof(IpmStats, perturb_time) / sizeof(uint64)] / 1000000.0);
+    /* the definition of version 1.2 lacks the memo columns */
+    if (tupdesc->natts > i + 1)
+    {
+        values[i++] = Int64GetDatum((int64) sums[offsetof(IpmStats, memo_hits) / sizeof(uint64)]);
+        values[i++] = Int64GetDatum((int64) sums[offsetof(IpmStats, memo_misses) / sizeof(uint64)]);
+    }
+    values[i++] = TimestampTzGetDatum((TimestampTz) pg_atomic_read_u64(&stats_array->reset_time));
+
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * pg_stat_ipm_reset() returns void
+ *
+ * Counts a backend flushes while the reset runs may survive it.
+ */
+Datum
+pg_stat_ipm_reset(PG_FUNCTION_ARGS)
+{
+    int			i;
+    int			j;
+
+    check_stats_array();
+
+    for (i = 0; i < stats_array->nslots; i++)
+    {
+        for (j = 0; j < IPM_STATS_NCOUNTERS; j++)
+            pg_atomic_write_u64(&stats_array->slots[i].counters[j], 0);
+    }
+    pg_atomic_write_u64(&stats_array->reset_time, (uint64) GetCurrentTimestamp());
+
+    PG_RETURN_VOID();
+}
@@ -0,0 +1,11 @@
+/* pg_ipm--1.0--1.1.sql */
+
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION pg_ipm UPDATE TO '1.1'" to load this file. \quit
+
+-- With row identity, for pg_ipm.noise = keyed
+CREATE FUNCTION ipm_perturb(value anyelement, owner oid, ident int2,
+                            tableoid oid, ctid tid)
+RETURNS anyelement
+AS 'MODULE_PATHNAME', 'ipm_perturb'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
@@ -0,0 +1,10 @@
+/* pg_ipm--1.0.sql */
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION pg_ipm" to load this file. \quit
+
+-- Called by the plans pg_ipm.mode = planner produces
+CREATE FUNCTION ipm_perturb(value anyelement, relid oid, attnum int2)
+RETURNS anyelement
+AS 'MODULE_PATHNAME', 'ipm_perturb'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
@@ -0,0 +1,26 @@
+/* pg_ipm--1.1--1.2.sql */
+
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION pg_ipm UPDATE TO '1.2'" to load this file. \quit
+
+-- Activity counters, summed over all backends
+CREATE FUNCTION pg_stat_ipm(OUT queries_bypassed int8,
+                            OUT queries_perturbed int8,
+                            OUT tuples_inspected int8,
+                            OUT tuples_perturbed int8,
+                            OUT nulls_skipped int8,
+                            OUT perturb_time float8,
+                            OUT stats_reset timestamptz)
+RETURNS record
+AS 'MODULE_PATHNAME', 'pg_stat_ipm'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION pg_stat_ipm_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'pg_stat_ipm_reset'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+REVOKE ALL ON FUNCTION pg_stat_ipm_reset() FROM PUBLIC;
+
+CREATE VIEW pg_stat_ipm AS
+    SELECT * FROM pg_stat_ipm();
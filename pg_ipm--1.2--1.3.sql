@@ -0,0 +1,24 @@
+/* pg_ipm--1.2--1.3.sql */
+
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION pg_ipm UPDATE TO '1.3'" to load this file. \quit
+
+-- pg_stat_ipm gains the hits and misses of pg_ipm.memo_size
+DROP VIEW pg_stat_ipm;
+DROP FUNCTION pg_stat_ipm();
+
+CREATE FUNCTION pg_stat_ipm(OUT queries_bypassed int8,
+                            OUT queries_perturbed int8,
+                            OUT tuples_inspected int8,
+                            OUT tuples_perturbed int8,
+                            OUT nulls_skipped int8,
+                            OUT perturb_time float8,
+                            OUT memo_hits int8,
+                            OUT memo_misses int8,
+                            OUT stats_reset timestamptz)
+RETURNS record
+AS 'MODULE_PATHNAME', 'pg_stat_ipm'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE VIEW pg_stat_ipm AS
+    SELECT * FROM pg_stat_ipm();
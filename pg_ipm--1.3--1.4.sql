@@ -0,0 +1,11 @@
+/* pg_ipm--1.3--1.4.sql */
+
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION pg_ipm UPDATE TO '1.4'" to load this file. \quit
+
+-- With the sensitivity of an aggregate result, for clamped sums
+CREATE FUNCTION ipm_perturb(value anyelement, owner oid, ident int2,
+                            sensitivity float8)
+RETURNS anyelement
+AS 'MODULE_PATHNAME', 'ipm_perturb'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
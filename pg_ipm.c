@@ -1,9 +1,15 @@
 /*-------------------------------------------------------------------------
  *
- * pg_sentinel.c
+ * pg_ipm.c
  *
- * Loadable PostgreSQL module to abort queries if a certain sentinel value
- * is SELECTed. E.g. in case of a SQL injection attack.
+ * Loadable PostgreSQL module that perturbs the values of protected columns
+ * in place as tuples are emitted.
+ *
+ * The module does not run the plan itself.  For queries that can see a
+ * protected relation it interposes a thin DestReceiver between the
+ * executor and the query's destination, which perturbs each slot and
+ * forwards it.  The plan is driven by standard_ExecutorRun or whatever
+ * other ExecutorRun hook is installed.
  *
  * Copyright 2022 Ernst-Georg Schmid
  *
@@ -16,165 +22,739 @@
 #include "fmgr.h"
 #include "funcapi.h"
 #include "executor/executor.h"
+#include "access/parallel.h"
 #include "access/xact.h"
+#include "portability/instr_time.h"
+#include "tcop/dest.h"
+#include "nodes/parsenodes.h"
+#include "nodes/plannodes.h"
 #include "utils/memutils.h"
 #include "utils/builtins.h"
 #include "utils/guc.h"
+#include "utils/lsyscache.h"
+
+#include "pg_ipm.h"
+#include "ipm_probes.h"
+#include "ipm_random.h"
 
 PG_MODULE_MAGIC;
 
 static bool abort_statement_only;
-static int relation_oid;
-static int col_no;
 static int elevel;
+int         ipm_batch_size = 0;
+static int fixed_seed = 0;
+int ipm_mode = IPM_MODE_EXECUTOR;
+int ipm_noise = IPM_NOISE_RANDOM;
+int ipm_aggregates = IPM_AGGREGATES_RESULT;
+double ipm_sample_rate = 1.0;
+
+static const struct config_enum_entry mode_options[] = {
+    {"executor", IPM_MODE_EXECUTOR, false},
+    {"planner", IPM_MODE_PLANNER, false},
+    {NULL, 0, false}
+};
+
+static const struct config_enum_entry noise_options[] = {
+    {"random", IPM_NOISE_RANDOM, false},
+    {"keyed", IPM_NOISE_KEYED, false},
+    {NULL, 0, false}
+};
+
+static const struct config_enum_entry budget_options[] = {
+    {"error", IPM_BUDGET_ERROR, false},
+    {"coarsen", IPM_BUDGET_COARSEN, false},
+    {NULL, 0, false}
+};
+
+static const struct config_enum_entry aggregates_options[] = {
+    {"input", IPM_AGGREGATES_INPUT, false},
+    {"result", IPM_AGGREGATES_RESULT, false},
+    {NULL, 0, false}
+};
+
+/*
+ * Slots buffered by the batch mode.  The slots are virtual copies of the
+ * tuples handed to the receiver, so they stay valid while later tuples are
+ * fetched.  values, words and rows are the gather buffer of one column.
+ */
+typedef struct IpmBatch
+{
+    int         size;           /* capacity, from pg_ipm.batch_size */
+    int         nslots;         /* slots currently buffered */
+    TupleDesc   tupdesc;        /* descriptor the slots were made for */
+    TupleTableSlot **slots;
+    Datum      *values;
+    uint64     *words;
+    int        *rows;
+    bool       *sampled;        /* per slot, for pg_ipm.sample_rate */
+} IpmBatch;
+
+/*
+ * A protected column with the kernels for its type.
+ */
+typedef struct IpmBoundColumn
+{
+    AttrNumber  attnum;
+    Oid         owner;          /* column identity for keyed noise */
+    AttrNumber  ident;
+    IpmNoiseSpec noise;
+    IpmKernel   kernel;
+    IpmBatchKernel batch_kernel;
+    bool        memo;           /* keyed and pass-by-value, see ipm_memo.c */
+} IpmBoundColumn;
+
+/*
+ * The rules of one relation, with kernels chosen for the column types the
+ * query's slots actually have.  Targets are bound on first use and kept
+ * for the rest of the query.  A target without columns stands for a
+ * relation that is not protected.
+ */
+typedef struct IpmTarget
+{
+    Oid         relid;
+    int         ncolumns;
+    AttrNumber  max_attnum;     /* highest attnum in columns */
+    IpmBoundColumn *columns;
+    TupleTableSlot *outslot;    /* virtual slot for perturbed copies */
+} IpmTarget;
+
+/*
+ * A protected relation whose tuples the query may emit.  rules are in the
+ * relation's own attnums, also when they are inherited from a partitioned
+ * table or inheritance parent.  With thousands of partitions there are as
+ * many members, which is why they are kept in an array sorted by relid
+ * rather than in a list.
+ */
+typedef struct IpmMember
+{
+    Oid         relid;
+    IpmRelationRules *rules;
+    IpmTarget  *target;         /* bound on the first tuple */
+} IpmMember;
+
+struct IpmQueryState;
+
+/*
+ * The interposed receiver.  inner is the query's real destination; it is
+ * set for the duration of each ExecutorRun call because portals hand a
+ * new destination to every FETCH.
+ */
+typedef struct IpmReceiver
+{
+    DestReceiver pub;
+    DestReceiver *inner;
+    struct IpmQueryState *qstate;
+    MemoryContext tuplecxt;     /* per-tuple context of the query */
+    bool        inner_open;     /* inner still accepts tuples */
+} IpmReceiver;
+
+/*
+ * Queries whose plan can emit tuples of a protected relation.  Everything
+ * else bypasses the module entirely.  Entries live in the query's
+ * es_query_cxt and unlink themselves when that context goes away, so an
+ * error in the middle of execution cannot leave a dangling entry behind.
+ */
+typedef struct IpmQueryState
+{
+    QueryDesc  *queryDesc;
+    struct IpmQueryState *next;
+    MemoryContextCallback cleanup;
+    IpmMember  *members;        /* sorted by relid */
+    int         nmembers;
+    IpmTarget   unprotected;    /* target of any other relation */
+    IpmTarget  *last_target;    /* target of the previous tuple */
+    bool        keyed;          /* pg_ipm.noise = keyed */
+    bool        coarse;         /* over budget, see ipm_budget.c */
+    float8      factor;         /* of the role's policy, see ipm_policy.c */
+    IpmSampler  sampler;        /* rows to perturb, see ipm_random.h */
+    IpmRandomState random;      /* the query's noise stream */
+    IpmBatch    batch;
+    IpmReceiver receiver;
+    uint64      nperturbed;     /* tuples perturbed so far */
+    IpmExplainInfo *explain;    /* set if EXPLAIN ANALYZE runs the query */
+    bool        timing;         /* time every tuple for EXPLAIN ANALYZE */
+    instr_time  perturb_time;   /* total, if timing */
+} IpmQueryState;
+
+static IpmQueryState *active_queries = NULL;
 
+static ExecutorStart_hook_type prev_ExecutorStart_hook = NULL;
 static ExecutorRun_hook_type prev_ExecutorRun_hook = NULL;
 
+static void sentinel_ExecutorStart(QueryDesc *queryDesc, int eflags);
+#ifdef IPM_HAVE_EXECUTE_ONCE
 static void sentinel_ExecutorRun(QueryDesc *queryDesc,
                                  ScanDirection direction, uint64 count, bool execute_once);
+#define IPM_EXECUTOR_RUN_ARGS queryDesc, direction, count, execute_once
+#else
+static void sentinel_ExecutorRun(QueryDesc *queryDesc,
+                                 ScanDirection direction, uint64 count);
+#define IPM_EXECUTOR_RUN_ARGS queryDesc, direction, count
+#endif
 
 void		_PG_init(void);
 void		_PG_fini(void);
 
+/*
+ * Bind the rules of a member relation to the column types of tupdesc.
+ *
+ * The type switch happens here, once per relation and query, so the tuple
+ * loop only calls through the chosen kernel pointers.  The column types
+ * come resolved with the rules, so binding needs no catalog access.
+ */
+static IpmTarget *
+bind_target(IpmQueryState *qstate, IpmMember *member, TupleDesc tupdesc)
+{
+    IpmRelationRules *rules = member->rules;
+    Oid         relid = member->relid;
+    IpmTarget  *target;
+    int         i;
+
+    target = (IpmTarget *) MemoryContextAllocZero(qstate->queryDesc->estate->es_query_cxt,
+                                                  sizeof(IpmTarget));
+    target->relid = relid;
+
+    if (rules != NULL)
+    {
+        target->columns = (IpmBoundColumn *)
+            MemoryContextAlloc(qstate->queryDesc->estate->es_query_cxt,
+                               sizeof(IpmBoundColumn) * rules->ncolumns);
+
+        for (i = 0; i < rules->ncolumns; i++)
+        {
+            AttrNumber  attnum = rules->columns[i].attnum;
+            IpmBoundColumn *col = &target->columns[target->ncolumns];
+            Form_pg_attribute attr;
+
+            if (attnum > tupdesc->natts)
+                ereport(ERROR,
+                        (errcode(ERRCODE_UNDEFINED_COLUMN),
+                         errmsg("pg_ipm rule for relation %u refers to nonexistent column %d",
+                                relid, attnum)));
+
+            attr = TupleDescAttr(tupdesc, attnum - 1);
+            if (attr->attisdropped)
+                continue;
+
+            if (!ipm_lookup_kernels(rules->columns[i].typid,
+                                    &col->kernel, &col->batch_kernel))
+                ereport(ERROR,
+                        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                         errmsg("pg_ipm cannot perturb column \"%s\" of type %s",
+                                NameStr(attr->attname),
+                                format_type_be(attr->atttypid))));
+
+            col->attnum = attnum;
+            col->owner = rules->columns[i].owner;
+            col->ident = rules->columns[i].ident;
+            col->noise = rules->columns[i].noise;
+            col->noise.scale *= qstate->factor;
+            if (qstate->coarse)
+                col->noise.scale *= IPM_COARSE_FACTOR;
+            col->memo = (qstate->keyed && ipm_memo_size > 0 &&
+                         rules->columns[i].typbyval);
+            target->max_attnum = Max(target->max_attnum, attnum);
+            target->ncolumns++;
+        }
+    }
+
+    if (target->ncolumns > 0)
+    {
+        MemoryContext oldcontext;
+
+        /* not fixed to tupdesc, see copy_to_outslot */
+        oldcontext = MemoryContextSwitchTo(qstate->queryDesc->estate->es_query_cxt);
+        target->outslot = ExecInitExtraTupleSlot(qstate->queryDesc->estate,
+                                                 NULL, &TTSOpsVirtual);
+        ExecSetSlotDescriptor(target->outslot, tupdesc);
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    return target;
+}
+
+/*
+ * Find the bound target for tuples of relation relid.  Relations that are
+ * not members share the unprotected target, which takes on relid so that
+ * the last-target check in perturb_slot hits for their next tuple.
+ */
+static IpmTarget *
+get_target(IpmQueryState *qstate, Oid relid, TupleDesc tupdesc)
+{
+    int         lo = 0;
+    int         hi = qstate->nmembers - 1;
+
+    while (lo <= hi)
+    {
+        int         mid = (lo + hi) / 2;
+        IpmMember  *member = &qstate->members[mid];
+
+        if (member->relid == relid)
+        {
+            if (member->target == NULL)
+                member->target = bind_target(qstate, member, tupdesc);
+            return member->target;
+        }
+        if (member->relid < relid)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+
+    qstate->unprotected.relid = relid;
+    return &qstate->unprotected;
+}
+
+/*
+ * Is the row in slot one of those pg_ipm.sample_rate selects?
+ */
+static inline bool
+sample_row(IpmQueryState *qstate, TupleTableSlot *slot)
+{
+    if (!qstate->sampler.active)
+        return true;
+
+    if (qstate->keyed)
+        return ipm_sample_keyed(&qstate->sampler,
+                                ipm_keyed_sample_word(slot->tts_tableOid,
+                                                      &slot->tts_tid));
+
+    return ipm_sample_next(&qstate->sampler);
+}
+
+/*
+ * Is it time to measure the perturbation for pg_stat_ipm?  Only one in
+ * IPM_TIMING_INTERVAL tuples or batches is timed, and the time measured
+ * stands for the whole interval.
+ */
+static inline bool
+timing_due(void)
+{
+    static uint32 tick = 0;
+
+    return (++tick % IPM_TIMING_INTERVAL) == 0;
+}
+
+/*
+ * Account the time since starttime, to pg_stat_ipm if the measurement was
+ * due and to the query if it is timed for EXPLAIN ANALYZE.
+ */
 static void
-ExecutePlan(EState *estate,
-            PlanState *planstate,
-            bool use_parallel_mode,
-            CmdType operation,
-            bool sendTuples,
-            uint64 numberTuples,
-            ScanDirection direction,
-            DestReceiver *dest)
+add_perturb_time(IpmQueryState *qstate, instr_time starttime, bool due)
 {
-    TupleTableSlot *slot;
-    int32 col_val;
-    Datum datum;
-    uint64 current_tuple_count;
-    bool isnull;
+    instr_time  endtime;
 
-    /*
-     * initialize local variables
-     */
-    current_tuple_count = 0;
+    INSTR_TIME_SET_CURRENT(endtime);
+    INSTR_TIME_SUBTRACT(endtime, starttime);
+    if (due)
+        ipm_stats.perturb_time += INSTR_TIME_GET_MICROSEC(endtime) * 1000 * IPM_TIMING_INTERVAL;
+    if (qstate->timing)
+        INSTR_TIME_ADD(qstate->perturb_time, endtime);
+}
 
-    /*
-     * Set the direction.
-     */
-    estate->es_direction = direction;
+/*
+ * Copy the values of a non-virtual slot into the target's output slot.
+ *
+ * The output slot takes the descriptor of the first slot the target was
+ * bound for.  Slots of the same relation normally share the relcache's
+ * descriptor, but nothing guarantees it, so a slot with a different one
+ * makes the output slot switch to it rather than copy a wrong number of
+ * values.
+ */
+static TupleTableSlot *
+copy_to_outslot(IpmTarget *target, TupleTableSlot *slot)
+{
+    TupleTableSlot *outslot = target->outslot;
+    TupleDesc   tupdesc = slot->tts_tupleDescriptor;
+    int         natts = tupdesc->natts;
 
-    /*
-     * If a tuple count was supplied, we must force the plan to run without
-     * parallelism, because we might exit early.
-     */
-    if (numberTuples)
-        use_parallel_mode = false;
+    if (outslot->tts_tupleDescriptor != tupdesc &&
+        !equalTupleDescs(outslot->tts_tupleDescriptor, tupdesc))
+    {
+        if (target->max_attnum > natts)
+            ereport(ERROR,
+                    (errcode(ERRCODE_UNDEFINED_COLUMN),
+                     errmsg("pg_ipm rule for relation %u refers to nonexistent column %d",
+                            target->relid, target->max_attnum)));
 
-    /*
-     * If a tuple count was supplied, we must force the plan to run without
-     * parallelism, because we might exit early.
-     */
-    if (use_parallel_mode)
-        EnterParallelMode();
+        ExecSetSlotDescriptor(outslot, tupdesc);
+    }
 
-    srand(time(NULL));
+    slot_getallattrs(slot);
 
-    rand();
+    ExecClearTuple(outslot);
+    memcpy(outslot->tts_values, slot->tts_values, natts * sizeof(Datum));
+    memcpy(outslot->tts_isnull, slot->tts_isnull, natts * sizeof(bool));
+    ExecStoreVirtualTuple(outslot);
+    outslot->tts_tableOid = slot->tts_tableOid;
+    outslot->tts_tid = slot->tts_tid;
 
-    /*
-     * Loop until we've processed the proper number of tuples from the plan.
-     */
-    for (;;)
+    return outslot;
+}
+
+/*
+ * Apply the rules of the slot's relation to the slot.  Returns the slot to
+ * be sent, which is either the input slot or the target's output slot.
+ *
+ * Consecutive tuples almost always come from the same relation, so the
+ * target of the previous tuple is checked first.  Only a change of
+ * relation, e.g. from one partition to the next, costs a binary search.
+ *
+ * The slot is first deformed only up to the highest protected column.
+ * Where the perturbed values are written then depends on the slot type:
+ *
+ * - Virtual slots, e.g. projection and junk filter results, own their
+ *   tts_values, which are written in place.
+ *
+ * - Heap, buffer heap and minimal tuple slots treat tts_values as a cache
+ *   of the stored tuple.  Any receiver that fetches or materializes the
+ *   tuple (a tuplestore for instance) would silently drop values written
+ *   there.  Instead the deformed values are copied, as plain Datums, into
+ *   the target's preallocated virtual slot, which is perturbed and sent.
+ *   That needs all of the tuple's values, so it is only done if one of the
+ *   protected columns is not NULL.  Pass-by-reference values keep pointing
+ *   into the input tuple, which stays pinned until the next tuple is
+ *   fetched, so no tuple is formed or copied.
+ *
+ * Rows pg_ipm.sample_rate passes over, and NULLs, are left alone without
+ * drawing any noise.  Keyed noise is derived from the tableOid and tid of
+ * the slot, which the output slot copies.  Kernels run in the per-tuple
+ * memory context, so pass-by-reference results are released by
+ * ResetPerTupleExprContext.
+ */
+static inline TupleTableSlot *
+perturb_slot(IpmQueryState *qstate, TupleTableSlot *slot, MemoryContext tuplecxt)
+{
+    IpmTarget  *target = qstate->last_target;
+    MemoryContext oldcontext;
+    instr_time  starttime;
+    bool        due;
+    int         i;
+
+    ipm_stats.tuples_inspected++;
+
+    if (target == NULL || slot->tts_tableOid != target->relid)
     {
-        /* Reset the per-output-tuple exprcontext */
-        ResetPerTupleExprContext(estate);
+        target = get_target(qstate, slot->tts_tableOid, slot->tts_tupleDescriptor);
+        qstate->last_target = target;
+    }
 
-        /*
-         * Execute the plan and obtain a tuple
-         */
-        slot = ExecProcNode(planstate);
+    if (target->ncolumns == 0 || !sample_row(qstate, slot))
+        return slot;
 
-        /*
-         * if the tuple is null, then we assume there is nothing more to
-         * process so we just end the loop...
-         */
-        if (TupIsNull(slot))
+    slot_getsomeattrs(slot, target->max_attnum);
+
+    if (!TTS_IS_VIRTUAL(slot))
+    {
+        for (i = 0; i < target->ncolumns; i++)
         {
-            /* Allow nodes to release or shut down resources. */
-            (void) ExecShutdownNode(planstate);
-            break;
+            if (!slot->tts_isnull[target->columns[i].attnum - 1])
+                break;
         }
 
-        /*
-         * If we have a junk filter, then project a new tuple with the junk
-         * removed.
-         *
-         * Store this new "clean" tuple in the junkfilter's resultSlot.
-         * (Formerly, we stored it back over the "dirty" tuple, which is WRONG
-         * because that tuple slot has the wrong descriptor.)
-         */
-        if (estate->es_junkFilter != NULL)
-            slot = ExecFilterJunk(estate->es_junkFilter, slot);
+        if (i == target->ncolumns)
+        {
+            ipm_stats.nulls_skipped += target->ncolumns;
+            return slot;
+        }
 
-        /*
-         * Count tuples processed, if this is a SELECT.  (For other operation
-         * types, the ModifyTable plan node must count the appropriate
-         * events.)
-         */
-        if (operation == CMD_SELECT)
+        slot = copy_to_outslot(target, slot);
+    }
+
+    qstate->nperturbed++;
+    due = timing_due();
+    if (due || qstate->timing)
+        INSTR_TIME_SET_CURRENT(starttime);
+
+    oldcontext = MemoryContextSwitchTo(tuplecxt);
+
+    for (i = 0; i < target->ncolumns; i++)
+    {
+        IpmBoundColumn *column = &target->columns[i];
+        int         col = column->attnum - 1;
+        Datum       value = slot->tts_values[col];
+        Datum       result;
+        uint64      word;
+
+        if (slot->tts_isnull[col])
         {
-            if(slot->tts_tableOid == relation_oid)
-            {
-                datum = slot_getattr(slot, col_no, &isnull);
-                col_val = DatumGetInt32(datum);
+            ipm_stats.nulls_skipped++;
+            continue;
+        }
 
-                //printf("%d\n", col_val);
+        if (column->memo &&
+            ipm_memo_lookup(column->owner, column->ident, slot->tts_tableOid,
+                            &slot->tts_tid, column->noise.scale, value, &result))
+        {
+            slot->tts_values[col] = result;
+            continue;
+        }
 
-                col_val += (rand() % (5 - (-5) + 1)) + (-5);
+        if (qstate->keyed)
+            word = ipm_keyed_row_word(column->owner, column->ident,
+                                      slot->tts_tableOid, &slot->tts_tid);
+        else
+            word = ipm_random_next(&qstate->random);
 
-                slot->tts_values[col_no-1] = Int32GetDatum(col_val);
+        result = column->kernel(value, word, &column->noise);
+        if (column->memo)
+            ipm_memo_store(column->owner, column->ident, slot->tts_tableOid,
+                           &slot->tts_tid, column->noise.scale, value, result);
+        slot->tts_values[col] = result;
+    }
 
-                //printf("%d\n", DatumGetInt32(slot->tts_values[col_no-1]));
-            }
+    MemoryContextSwitchTo(oldcontext);
 
+    if (due || qstate->timing)
+        add_perturb_time(qstate, starttime, due);
 
-            (estate->es_processed)++;
+    return slot;
+}
+
+/*
+ * (Re)create the batch slots for tuples of descriptor tupdesc.  The batch
+ * must be empty.
+ */
+static void
+batch_init(IpmBatch *batch, TupleDesc tupdesc, MemoryContext cxt)
+{
+    MemoryContext oldcontext;
+    int         i;
+
+    Assert(batch->nslots == 0);
+
+    oldcontext = MemoryContextSwitchTo(cxt);
+
+    if (batch->slots == NULL)
+    {
+        batch->slots = (TupleTableSlot **) palloc0(sizeof(TupleTableSlot *) * batch->size);
+        batch->values = (Datum *) palloc(sizeof(Datum) * batch->size);
+        batch->words = (uint64 *) palloc(sizeof(uint64) * batch->size);
+        batch->rows = (int *) palloc(sizeof(int) * batch->size);
+        batch->sampled = (bool *) palloc(sizeof(bool) * batch->size);
+    }
+
+    for (i = 0; i < batch->size; i++)
+    {
+        if (batch->slots[i] != NULL)
+            ExecDropSingleTupleTableSlot(batch->slots[i]);
+        batch->slots[i] = MakeSingleTupleTableSlot(tupdesc, &TTSOpsVirtual);
+    }
+    batch->tupdesc = tupdesc;
+
+    MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Run the batch kernel of one rule over rows [start, end) of the batch,
+ * which all belong to the same relation.  The noise words are made in a
+ * separate pass over the gathered rows, so the keyed hash runs as a tight
+ * loop just like the generator.
+ */
+static void
+batch_perturb_column(IpmQueryState *qstate, IpmBoundColumn *rule, int start,
+                     int end)
+{
+    IpmBatch   *batch = &qstate->batch;
+    int         col = rule->attnum - 1;
+    int         n = 0;
+    int         i;
+
+    /* gather */
+    for (i = start; i < end; i++)
+    {
+        TupleTableSlot *bslot = batch->slots[i];
+
+        if (!batch->sampled[i])
+            continue;
+
+        if (bslot->tts_isnull[col])
+            ipm_stats.nulls_skipped++;
+        else if (rule->memo &&
+                 ipm_memo_lookup(rule->owner, rule->ident, bslot->tts_tableOid,
+                                 &bslot->tts_tid, rule->noise.scale,
+                                 bslot->tts_values[col],
+                                 &bslot->tts_values[col]))
+            continue;
+        else
+        {
+            batch->values[n] = bslot->tts_values[col];
+            batch->rows[n] = i;
+            n++;
         }
+    }
 
-        /*
-         * If we are supposed to send the tuple somewhere, do so. (In
-         * practice, this is probably always the case at this point.)
-         */
-        if (sendTuples)
+    if (n == 0)
+        return;
+
+    if (qstate->keyed)
+    {
+        for (i = 0; i < n; i++)
         {
-            /*
-             * If we are not able to send the tuple, we assume the destination
-             * has closed and no more tuples can be sent. If that's the case,
-             * end the loop.
-             */
-            if (!((*dest->receiveSlot) (slot, dest)))
-                break;
+            TupleTableSlot *bslot = batch->slots[batch->rows[i]];
+
+            batch->words[i] = ipm_keyed_row_word(rule->owner, rule->ident,
+                                                 bslot->tts_tableOid,
+                                                 &bslot->tts_tid);
         }
+    }
+    else
+        ipm_random_fill(&qstate->random, batch->words, n);
 
-        /*
-         * check our tuple count.. if we've processed the proper number then
-         * quit, else loop again and process more tuples.  Zero numberTuples
-         * means no limit.
-         */
-        current_tuple_count++;
+    rule->batch_kernel(batch->values, batch->words, n, &rule->noise);
+
+    /* scatter */
+    for (i = 0; i < n; i++)
+    {
+        TupleTableSlot *bslot = batch->slots[batch->rows[i]];
+
+        if (rule->memo)
+            ipm_memo_store(rule->owner, rule->ident, bslot->tts_tableOid,
+                           &bslot->tts_tid, rule->noise.scale,
+                           bslot->tts_values[col], batch->values[i]);
+        bslot->tts_values[col] = batch->values[i];
+    }
+}
+
+/*
+ * Perturb all buffered slots and hand them to the destination.  Returns
+ * false if the destination does not accept any more tuples.
+ */
+static bool
+batch_flush(IpmQueryState *qstate, DestReceiver *dest, MemoryContext tuplecxt)
+{
+    IpmBatch   *batch = &qstate->batch;
+    MemoryContext oldcontext;
+    instr_time  starttime;
+    bool        due = timing_due();
+    int         start = 0;
+    int         i;
+    bool        ok = true;
 
-        if (numberTuples && numberTuples == current_tuple_count)
+    ipm_stats.tuples_inspected += batch->nslots;
+    if (due || qstate->timing)
+        INSTR_TIME_SET_CURRENT(starttime);
+
+    oldcontext = MemoryContextSwitchTo(tuplecxt);
+
+    while (start < batch->nslots)
+    {
+        Oid         relid = batch->slots[start]->tts_tableOid;
+        IpmTarget  *target;
+        int         end = start + 1;
+
+        while (end < batch->nslots && batch->slots[end]->tts_tableOid == relid)
+            end++;
+
+        target = get_target(qstate, relid, batch->tupdesc);
+        if (target->ncolumns > 0)
+        {
+            /* sample whole rows, before the columns are perturbed */
+            for (i = start; i < end; i++)
+            {
+                batch->sampled[i] = sample_row(qstate, batch->slots[i]);
+                qstate->nperturbed += batch->sampled[i];
+            }
+        }
+        for (i = 0; i < target->ncolumns; i++)
+            batch_perturb_column(qstate, &target->columns[i], start, end);
+
+        start = end;
+    }
+
+    MemoryContextSwitchTo(oldcontext);
+
+    if (due || qstate->timing)
+        add_perturb_time(qstate, starttime, due);
+    IPM_TRACE_BATCH_DONE(batch->nslots);
+
+    for (i = 0; i < batch->nslots; i++)
+    {
+        if (!((*dest->receiveSlot) (batch->slots[i], dest)))
+        {
+            ok = false;
             break;
+        }
+    }
+
+    batch->nslots = 0;
+    return ok;
+}
+
+/*
+ * Receiver callbacks.  Everything but receiveSlot is forwarded to the
+ * real destination.
+ */
+static void
+ipm_receiver_startup(DestReceiver *self, int operation, TupleDesc typeinfo)
+{
+    IpmReceiver *receiver = (IpmReceiver *) self;
+
+    receiver->inner_open = true;
+    receiver->inner->rStartup(receiver->inner, operation, typeinfo);
+}
+
+static bool
+ipm_receiver_receive(TupleTableSlot *slot, DestReceiver *self)
+{
+    IpmReceiver *receiver = (IpmReceiver *) self;
+    IpmQueryState *qstate = receiver->qstate;
+    IpmBatch   *batch = &qstate->batch;
+
+    if (batch->size <= 1)
+    {
+        slot = perturb_slot(qstate, slot, receiver->tuplecxt);
+        return receiver->inner->receiveSlot(slot, receiver->inner);
     }
 
     /*
-      * If we know we won't need to back up, we can release resources at this
-      * point.
-      */
-     if (!(estate->es_top_eflags & EXEC_FLAG_BACKWARD))
-         ExecShutdownNode(planstate);
-
-    if (use_parallel_mode)
-        ExitParallelMode();
+     * Buffer a copy of the tuple; the batch is perturbed and sent as a
+     * whole once it is full.  Whatever is left over is sent at shutdown.
+     */
+    if (slot->tts_tupleDescriptor != batch->tupdesc)
+    {
+        if (batch->nslots > 0 &&
+            !batch_flush(qstate, receiver->inner, receiver->tuplecxt))
+        {
+            receiver->inner_open = false;
+            return false;
+        }
+        batch_init(batch, slot->tts_tupleDescriptor,
+                   qstate->queryDesc->estate->es_query_cxt);
+    }
+
+    ExecCopySlot(batch->slots[batch->nslots], slot);
+    batch->slots[batch->nslots]->tts_tableOid = slot->tts_tableOid;
+    batch->slots[batch->nslots]->tts_tid = slot->tts_tid;
+    batch->nslots++;
+
+    if (batch->nslots == batch->size &&
+        !batch_flush(qstate, receiver->inner, receiver->tuplecxt))
+    {
+        receiver->inner_open = false;
+        return false;
+    }
+
+    return true;
+}
+
+static void
+ipm_receiver_shutdown(DestReceiver *self)
+{
+    IpmReceiver *receiver = (IpmReceiver *) self;
+    IpmBatch   *batch = &receiver->qstate->batch;
+
+    if (receiver->inner_open && batch->nslots > 0)
+        (void) batch_flush(receiver->qstate, receiver->inner, receiver->tuplecxt);
+    batch->nslots = 0;
+
+    receiver->inner->rShutdown(receiver->inner);
+}
+
+static void
+ipm_receiver_destroy(DestReceiver *self)
+{
+    /* The receiver lives in es_query_cxt; the inner one is not ours. */
 }
 
 
@@ -185,13 +765,112 @@ void
 _PG_init(void)
 {
     /* Define custom GUC variable. */
-    DefineCustomIntVariable("pg_sentinel.relation_oid",
-                            "Selects the table by Oid "
-                            "that contains the sentinel value.",
-                            "Oid can be determinded with: SELECT '<schema>.<tablename>'::regclass::oid;",
-                            &relation_oid,
-                            0,
-                            0, INT_MAX,
+    DefineCustomIntVariable("pg_ipm.max_rules",
+                            "Sets the maximum number of rules.",
+                            "Sizes the rule directory in shared memory.",
+                            &ipm_max_rules,
+                            1000,
+                            0, INT_MAX / 2,
+                            PGC_POSTMASTER,
+                            0, /* no flags required */
+                            NULL,
+                            NULL,
+                            NULL);
+
+    /* Define custom GUC variable. */
+    DefineCustomStringVariable("pg_ipm.rules",
+                               "Lists the protected columns.",
+                               "Comma separated list of schema.table.column names or relid:attnum pairs.",
+                               &ipm_rules,
+                               "",
+                               PGC_SIGHUP,
+                               GUC_LIST_INPUT,
+                               ipm_check_rules,
+                               ipm_assign_rules,
+                               NULL);
+
+    /* Define custom GUC variable. */
+    DefineCustomEnumVariable("pg_ipm.mode",
+                             "Selects where protected values are perturbed.",
+                             "executor perturbs the tuples a query emits; planner compiles the perturbation into the query's output expressions.",
+                             &ipm_mode,
+                             IPM_MODE_EXECUTOR,
+                             mode_options,
+                             PGC_SUSET,
+                             0, /* no flags required */
+                             NULL,
+                             ipm_assign_mode,
+                             NULL);
+
+    /* Define custom GUC variable. */
+    DefineCustomEnumVariable("pg_ipm.aggregates",
+                             "Selects how aggregates over protected columns are perturbed in planner mode.",
+                             "input perturbs every value an aggregate reads; result perturbs the result of count, and of sum over columns with a clamp, once per group.",
+                             &ipm_aggregates,
+                             IPM_AGGREGATES_RESULT,
+                             aggregates_options,
+                             PGC_SIGHUP,
+                             0, /* no flags required */
+                             NULL,
+                             ipm_assign_aggregates,
+                             NULL);
+
+    /* Define custom GUC variable. */
+    DefineCustomEnumVariable("pg_ipm.noise",
+                             "Selects how the noise is drawn.",
+                             "random draws fresh noise on every execution; keyed derives it from a keyed hash of row and column, so repeated queries return the same values.",
+                             &ipm_noise,
+                             IPM_NOISE_RANDOM,
+                             noise_options,
+                             PGC_SUSET,
+                             0, /* no flags required */
+                             NULL,
+                             NULL,
+                             NULL);
+
+    /* Define custom GUC variable. */
+    DefineCustomStringVariable("pg_ipm.policies",
+                               "Sets the noise policies of roles.",
+                               "Comma separated list of role or role@database, each followed by exempt or a factor for the noise scale.",
+                               &ipm_policies,
+                               "",
+                               PGC_SIGHUP,
+                               GUC_LIST_INPUT,
+                               ipm_check_policies,
+                               ipm_assign_policies,
+                               NULL);
+
+    /* Define custom GUC variable. */
+    DefineCustomStringVariable("pg_ipm.secret",
+                               "Sets the secret the keyed noise is derived from.",
+                               NULL,
+                               &ipm_secret,
+                               "",
+                               PGC_SIGHUP,
+                               GUC_SUPERUSER_ONLY,
+                               NULL,
+                               ipm_assign_secret,
+                               NULL);
+
+    /* Define custom GUC variable. */
+    DefineCustomStringVariable("pg_ipm.decoding_plugin",
+                               "Sets the output plugin the pg_ipm output plugin wraps.",
+                               "Replication slots created with the pg_ipm plugin run this plugin on perturbed changes.",
+                               &ipm_decoding_plugin,
+                               "pgoutput",
+                               PGC_SIGHUP,
+                               0, /* no flags required */
+                               NULL,
+                               NULL,
+                               NULL);
+
+    /* Define custom GUC variable. */
+    DefineCustomIntVariable("pg_ipm.max_roles",
+                            "Sets the maximum number of roles with a privacy budget.",
+                            "Sizes the budget table in shared memory. 0 disables pg_ipm.epsilon_per_day.",
+                            &ipm_max_roles,
+                            1000,
+                            0, INT_MAX / 2,
                             PGC_POSTMASTER,
                             0, /* no flags required */
                             NULL,
@@ -199,22 +878,130 @@ _PG_init(void)
                             NULL);
 
     /* Define custom GUC variable. */
-    DefineCustomIntVariable("pg_sentinel.column_no",
-                            "Sets the column position in the table "
-                            "which contains the sentinel value.",
-                            "Column position can be determined by: SELECT ordinal_position FROM information_schema.columns WHERE table_name='<tablename>' AND column_name = '<column_name>';",
-                            &col_no,
+    DefineCustomRealVariable("pg_ipm.epsilon_per_query",
+                             "Sets the privacy budget a single query may spend.",
+                             "Only Laplace rules spend budget, epsilon = 1/scale per column. 0 means no limit.",
+                             &ipm_epsilon_per_query,
+                             0.0,
+                             0.0, 1000000.0,
+                             PGC_SIGHUP,
+                             0, /* no flags required */
+                             NULL,
+                             NULL,
+                             NULL);
+
+    /* Define custom GUC variable. */
+    DefineCustomRealVariable("pg_ipm.epsilon_per_day",
+                             "Sets the privacy budget each role may spend per day.",
+                             "Only Laplace rules spend budget, epsilon = 1/scale per column. 0 means no limit.",
+                             &ipm_epsilon_per_day,
+                             0.0,
+                             0.0, 1000000.0,
+                             PGC_SIGHUP,
+                             0, /* no flags required */
+                             NULL,
+                             NULL,
+                             NULL);
+
+    /* Define custom GUC variable. */
+    DefineCustomEnumVariable("pg_ipm.budget_exhausted",
+                             "Selects what happens to queries over the daily privacy budget.",
+                             "error makes them fail; coarsen runs them with noise scaled up tenfold, without charging them.",
+                             &ipm_budget_policy,
+                             IPM_BUDGET_ERROR,
+                             budget_options,
+                             PGC_SIGHUP,
+                             0, /* no flags required */
+                             NULL,
+                             NULL,
+                             NULL);
+
+    /* Define custom GUC variable. */
+    DefineCustomBoolVariable("pg_ipm.query_coarse",
+                             "Shows whether the current query runs with coarse noise.",
+                             "Set by pg_ipm when it charges a query, for its parallel workers.",
+                             &ipm_query_coarse,
+                             false,
+                             PGC_SUSET,
+                             GUC_NO_SHOW_ALL | GUC_NO_RESET_ALL |
+                             GUC_NOT_IN_SAMPLE | GUC_DISALLOW_IN_FILE,
+                             NULL,
+                             NULL,
+                             NULL);
+
+    /* Define custom GUC variable. */
+    DefineCustomRealVariable("pg_ipm.sample_rate",
+                             "Sets the fraction of rows that are perturbed.",
+                             "Rows are sampled at random, or by a keyed hash of the row with keyed noise.",
+                             &ipm_sample_rate,
+                             1.0,
+                             0.0, 1.0,
+                             PGC_SUSET,
+                             0, /* no flags required */
+                             NULL,
+                             NULL,
+                             NULL);
+
+    /* Define custom GUC variable. */
+    DefineCustomIntVariable("pg_ipm.memo_size",
+                            "Sets the memory for remembering keyed perturbed values.",
+                            "Repeated reads of a row with keyed noise reuse its perturbed values. 0 disables the memo.",
+                            &ipm_memo_size,
+                            0,
+                            0, MAX_KILOBYTES,
+                            PGC_USERSET,
+                            GUC_UNIT_KB,
+                            NULL,
+                            ipm_assign_memo_size,
+                            NULL);
+
+    /* Define custom GUC variable. */
+    DefineCustomIntVariable("pg_ipm.batch_size",
+                            "Sets the number of tuples perturbed as one batch.",
+                            "Batching trades latency for throughput. 0 or 1 perturbs every tuple as it is produced.",
+                            &ipm_batch_size,
+                            0,
+                            0, IPM_MAX_BATCH_SIZE,
+                            PGC_USERSET,
+                            0, /* no flags required */
+                            NULL,
+                            NULL,
+                            NULL);
+
+    /* Define custom GUC variable. */
+    DefineCustomIntVariable("pg_ipm.seed",
+                            "Sets a fixed seed for the noise of every query.",
+                            "0 seeds every backend from the strong random source. "
+                            "Any other value makes the noise of a query reproducible; parallel workers draw from their own stream of the same seed.",
+                            &fixed_seed,
                             0,
                             0, INT_MAX,
-                            PGC_POSTMASTER,
+                            PGC_SUSET,
                             0, /* no flags required */
                             NULL,
                             NULL,
                             NULL);
 
-    /* install the hook */
+    /* choose the kernel implementations for this CPU */
+    ipm_kernels_init();
+
+    /* publish the rules in shared memory */
+    ipm_rules_init();
+
+    /* and keep the privacy budgets there */
+    ipm_budget_init();
+
+    /* and the pg_stat_ipm counters */
+    ipm_stats_init();
+
+    /* install the hooks */
+    prev_ExecutorStart_hook = ExecutorStart_hook;
+    ExecutorStart_hook = sentinel_ExecutorStart;
     prev_ExecutorRun_hook = ExecutorRun_hook;
     ExecutorRun_hook = sentinel_ExecutorRun;
+    ipm_planner_init();
+    ipm_explain_init();
+    ipm_copy_init();
 
     if (abort_statement_only)
     {
@@ -232,75 +1019,452 @@ _PG_init(void)
 void
 _PG_fini(void)
 {
-    /* Uninstall hook. */
+    /* Uninstall hooks. */
+    ExecutorStart_hook = prev_ExecutorStart_hook;
     ExecutorRun_hook = prev_ExecutorRun_hook;
+    ipm_copy_fini();
+    ipm_explain_fini();
+    ipm_planner_fini();
+    ipm_stats_fini();
+    ipm_budget_fini();
+    ipm_rules_fini();
 }
 
-void
-sentinel_ExecutorRun(QueryDesc *queryDesc,
-                     ScanDirection direction, uint64 count,bool execute_once)
+static void
+add_member(IpmMember **members, int *nmembers, int *maxmembers,
+           Oid relid, IpmRelationRules *rules)
+{
+    IpmMember  *member;
+
+    if (*nmembers == *maxmembers)
+    {
+        *maxmembers = Max(*maxmembers * 2, 16);
+        if (*members == NULL)
+            *members = (IpmMember *) palloc(sizeof(IpmMember) * *maxmembers);
+        else
+            *members = (IpmMember *) repalloc(*members,
+                                              sizeof(IpmMember) * *maxmembers);
+    }
+
+    member = &(*members)[(*nmembers)++];
+    member->relid = relid;
+    member->rules = rules;
+    member->target = NULL;
+}
+
+static int
+member_cmp(const void *a, const void *b)
+{
+    Oid         ra = ((const IpmMember *) a)->relid;
+    Oid         rb = ((const IpmMember *) b)->relid;
+
+    return (ra > rb) - (ra < rb);
+}
+
+/*
+ * Copy rules into the current memory context.  The backend's rule caches
+ * may be rebuilt by any later query, which can run between two fetches
+ * from a cursor.
+ */
+static IpmRelationRules *
+copy_rules(IpmRelationRules *rules)
 {
+    IpmRelationRules *copy = (IpmRelationRules *) palloc(sizeof(IpmRelationRules));
+
+    copy->relid = rules->relid;
+    copy->ncolumns = rules->ncolumns;
+    copy->columns = (IpmColumnRule *) palloc(sizeof(IpmColumnRule) * rules->ncolumns);
+    memcpy(copy->columns, rules->columns, sizeof(IpmColumnRule) * rules->ncolumns);
+
+    return copy;
+}
+
+/*
+ * Collect the protected relations the plan may emit tuples of, in the
+ * current memory context.  Returns NULL if there are none.
+ *
+ * Scan slots carry the OID of the leaf relation they were read from, not
+ * that of the partitioned table or inheritance parent the rules are
+ * configured on.  The planner adds every partition and child it may scan
+ * to the range table, so resolving each range table entry through the
+ * backend's cache of inherited rules yields the complete set, without
+ * catalog access once the cache is warm.
+ */
+static IpmMember *
+collect_members(PlannedStmt *plannedstmt, int *nmembers)
+{
+    IpmMember  *members = NULL;
+    int         n = 0;
+    int         max = 0;
+    IpmRelationRules *lastrules = NULL;
+    IpmRelationRules *lastcopy = NULL;
+    int         i;
+    int         j;
+    ListCell   *lc;
+
+    ipm_rules_refresh();
+
+    foreach(lc, plannedstmt->rtable)
+    {
+        RangeTblEntry *rte = (RangeTblEntry *) lfirst(lc);
+        IpmRelationRules *rules;
+
+        if (rte->rtekind != RTE_RELATION)
+            continue;
+
+        rules = ipm_lookup_inherited_rules(rte->relid);
+        if (rules != NULL)
+            add_member(&members, &n, &max, rte->relid, rules);
+    }
+
+    if (n == 0)
+    {
+        *nmembers = 0;
+        return NULL;
+    }
+
+    /* the partitions of a table share its rules, and thus one copy */
+    for (i = 0; i < n; i++)
+    {
+        if (members[i].rules != lastrules)
+        {
+            lastrules = members[i].rules;
+            lastcopy = copy_rules(lastrules);
+        }
+        members[i].rules = lastcopy;
+    }
+
+    if (n > 1)
+    {
+        qsort(members, n, sizeof(IpmMember), member_cmp);
+
+        for (i = 1, j = 0; i < n; i++)
+        {
+            if (members[i].relid != members[j].relid)
+                members[++j] = members[i];
+        }
+        n = j + 1;
+    }
+
+    *nmembers = n;
+    return members;
+}
+
+/*
+ * The number of distinct rules the bound targets of a query apply.
+ * Partitions that inherit a rule share it.
+ */
+static int
+count_applied_rules(IpmQueryState *qstate)
+{
+    IpmBoundColumn **seen = NULL;
+    int         nseen = 0;
+    int         maxseen = 0;
+    int         i;
+
+    for (i = 0; i < qstate->nmembers; i++)
+    {
+        IpmTarget  *target = qstate->members[i].target;
+        int         j;
+
+        if (target == NULL)
+            continue;
+
+        for (j = 0; j < target->ncolumns; j++)
+        {
+            IpmBoundColumn *column = &target->columns[j];
+            int         k;
+
+            for (k = 0; k < nseen; k++)
+            {
+                if (seen[k]->owner == column->owner && seen[k]->ident == column->ident)
+                    break;
+            }
+            if (k < nseen)
+                continue;
+
+            if (nseen == maxseen)
+            {
+                maxseen = Max(maxseen * 2, 8);
+                if (seen == NULL)
+                    seen = (IpmBoundColumn **) palloc(sizeof(IpmBoundColumn *) * maxseen);
+                else
+                    seen = (IpmBoundColumn **) repalloc(seen,
+                                                        sizeof(IpmBoundColumn *) * maxseen);
+            }
+            seen[nseen++] = column;
+        }
+    }
+
+    if (seen != NULL)
+        pfree(seen);
+
+    return nseen;
+}
+
+/*
+ * Memory context reset callback: forget a query once its executor state is
+ * released, whether by ExecutorEnd or by error cleanup.  Its counts go to
+ * pg_stat_ipm, and to EXPLAIN ANALYZE if that is still waiting for them.
+ */
+static void
+forget_query(void *arg)
+{
+    IpmQueryState *qstate = (IpmQueryState *) arg;
+    IpmQueryState **prev;
+
+    ipm_stats.tuples_perturbed += qstate->nperturbed;
+
+    if (qstate->explain != NULL && qstate->explain == ipm_explain_query)
+    {
+        qstate->explain->nrules = count_applied_rules(qstate);
+        qstate->explain->tuples_perturbed = qstate->nperturbed;
+        qstate->explain->perturb_time = INSTR_TIME_GET_MILLISEC(qstate->perturb_time);
+    }
+
+    for (prev = &active_queries; *prev != NULL; prev = &(*prev)->next)
+    {
+        if (*prev == qstate)
+        {
+            *prev = qstate->next;
+            break;
+        }
+    }
+}
+
+static IpmQueryState *
+lookup_query(QueryDesc *queryDesc)
+{
+    IpmQueryState *qstate;
+
+    for (qstate = active_queries; qstate != NULL; qstate = qstate->next)
+    {
+        if (qstate->queryDesc == queryDesc)
+            return qstate;
+    }
+
+    return NULL;
+}
+
+/*
+ * ExecutorStart hook: decide once per query whether we have to interpose
+ * on its execution.
+ *
+ * Parallel workers run their part of the plan through ExecutorStart and
+ * ExecutorRun as well, with a tuple queue as destination.  Tuples of
+ * protected relations are therefore perturbed in the worker that scans
+ * them, below the Gather node, and perturbation scales with the number of
+ * workers.  What the leader reads back from the queues carries no
+ * tableOid, so it is not perturbed a second time; only the tuples the
+ * leader scans itself are perturbed in the leader.
+ */
+static void
+sentinel_ExecutorStart(QueryDesc *queryDesc, int eflags)
+{
+    IpmQueryState *qstate;
+    IpmMember  *members;
+    int         nmembers;
     EState	   *estate;
-    CmdType		operation;
-    DestReceiver *dest;
-    bool		sendTuples;
     MemoryContext oldcontext;
+    IpmExplainInfo *explain = NULL;
+    const IpmPolicy *policy = NULL;
+    bool        coarse = ipm_query_coarse;
 
-    /* sanity checks */
-    Assert(queryDesc != NULL);
+    /* planner mode also perturbs RETURNING lists */
+    if (!(eflags & EXEC_FLAG_EXPLAIN_ONLY) &&
+        (queryDesc->operation == CMD_SELECT ||
+         (ipm_mode == IPM_MODE_PLANNER && queryDesc->plannedstmt->hasReturning)))
+    {
+        ipm_wait_event_init();
+        policy = ipm_current_policy();
 
-    estate = queryDesc->estate;
+        /*
+         * The leader charges the privacy budget for the whole query, before
+         * the executor enters parallel mode; workers get its decision on
+         * coarse noise with its settings, see ipm_budget.c.
+         */
+        if (!policy->exempt && !IsParallelWorker())
+            coarse = ipm_budget_charge(queryDesc->plannedstmt, policy->factor);
+    }
+
+    if (prev_ExecutorStart_hook)
+        prev_ExecutorStart_hook(queryDesc, eflags);
+    else
+        standard_ExecutorStart(queryDesc, eflags);
+
+    if (eflags & EXEC_FLAG_EXPLAIN_ONLY)
+        return;
+
+    /* the first query EXPLAIN ANALYZE starts is the one it explains */
+    if (ipm_explain_query != NULL && !ipm_explain_query->started &&
+        !IsParallelWorker())
+    {
+        explain = ipm_explain_query;
+        explain->started = true;
+    }
 
-    Assert(estate != NULL);
-    Assert(!(estate->es_top_eflags & EXEC_FLAG_EXPLAIN_ONLY));
+    if (queryDesc->operation != CMD_SELECT)
+        return;
+
+    /* members of exempt roles bypass pg_ipm like unprotected queries */
+    if (policy->exempt)
+    {
+        IPM_TRACE_BYPASS(true);
+        if (ipm_mode == IPM_MODE_EXECUTOR)
+        {
+            ipm_stats.queries_bypassed++;
+            if (explain != NULL)
+                explain->executor = true;
+        }
+        return;
+    }
 
     /*
-     * Switch into per-query memory context
+     * In planner mode the plan itself does the perturbation, drawing from
+     * the backend's generator.
      */
+    if (ipm_mode != IPM_MODE_EXECUTOR)
+    {
+        if (fixed_seed != 0)
+            ipm_random_seed_stream(&ipm_random, (uint64) fixed_seed,
+                                   IsParallelWorker() ? ParallelWorkerNumber + 1 : 0);
+        return;
+    }
+
+    estate = queryDesc->estate;
+
     oldcontext = MemoryContextSwitchTo(estate->es_query_cxt);
+    members = collect_members(queryDesc->plannedstmt, &nmembers);
+    MemoryContextSwitchTo(oldcontext);
 
-    /* Allow instrumentation of Executor overall runtime */
-    if (queryDesc->totaltime)
-        InstrStartNode(queryDesc->totaltime);
+    if (explain != NULL)
+        explain->executor = true;
 
-    /*
-     * extract information from the query descriptor and the query feature.
-     */
-    operation = queryDesc->operation;
-    dest = queryDesc->dest;
+    if (nmembers == 0)
+    {
+        IPM_TRACE_BYPASS(false);
+        ipm_stats.queries_bypassed++;
+        return;
+    }
+    ipm_stats.queries_perturbed++;
+
+    qstate = (IpmQueryState *) MemoryContextAllocZero(estate->es_query_cxt,
+                                                      sizeof(IpmQueryState));
+    qstate->queryDesc = queryDesc;
+    qstate->members = members;
+    qstate->nmembers = nmembers;
+    qstate->cleanup.func = forget_query;
+    qstate->cleanup.arg = qstate;
+    /* bulk exports do not care about latency */
+    if (ipm_batch_size == 0 && queryDesc->dest->mydest == DestCopyOut)
+        qstate->batch.size = IPM_COPY_BATCH_SIZE;
+    else
+        qstate->batch.size = ipm_batch_size;
+    IPM_TRACE_QUERY_START(nmembers, qstate->batch.size);
+    qstate->keyed = (ipm_noise == IPM_NOISE_KEYED);
+    qstate->coarse = coarse;
+    qstate->factor = policy->factor;
+    qstate->explain = explain;
+    qstate->timing = (explain != NULL &&
+                      (queryDesc->instrument_options & INSTRUMENT_TIMER) != 0);
+    qstate->receiver.pub.receiveSlot = ipm_receiver_receive;
+    qstate->receiver.pub.rStartup = ipm_receiver_startup;
+    qstate->receiver.pub.rShutdown = ipm_receiver_shutdown;
+    qstate->receiver.pub.rDestroy = ipm_receiver_destroy;
+    qstate->receiver.qstate = qstate;
+    MemoryContextRegisterResetCallback(estate->es_query_cxt, &qstate->cleanup);
+
+    if (qstate->keyed)
+        ipm_keyed_prepare();
 
     /*
-     * startup tuple receiver, if we will be emitting tuples
+     * The query draws from a stream of its own, which lasts as long as its
+     * executor state, so every FETCH from a cursor continues where the
+     * previous one stopped.  With a fixed seed the stream restarts the
+     * sequence of that seed.  The setting reaches parallel workers with the
+     * rest of the GUC state in the query's DSM segment; each worker derives
+     * its own stream from it.
      */
-    estate->es_processed = 0;
+    if (fixed_seed != 0)
+        ipm_random_seed_stream(&qstate->random, (uint64) fixed_seed,
+                               IsParallelWorker() ? ParallelWorkerNumber + 1 : 0);
+    else
+        ipm_random_split(&qstate->random);
+
+    ipm_sampler_init(&qstate->sampler, ipm_sample_rate, &qstate->random);
+
+    qstate->next = active_queries;
+    active_queries = qstate;
+}
 
-    sendTuples = (operation == CMD_SELECT ||
-                  queryDesc->plannedstmt->hasReturning);
+/*
+ * ExecutorRun hook: route the tuples of affected queries through the
+ * perturbing receiver.
+ */
+#ifdef IPM_HAVE_EXECUTE_ONCE
+static void
+sentinel_ExecutorRun(QueryDesc *queryDesc,
+                     ScanDirection direction, uint64 count, bool execute_once)
+#else
+static void
+sentinel_ExecutorRun(QueryDesc *queryDesc,
+                     ScanDirection direction, uint64 count)
+#endif
+{
+    IpmQueryState *qstate;
+    IpmReceiver *receiver;
+    DestReceiver *dest;
 
-    if (sendTuples)
-        (*dest->rStartup) (dest, operation, queryDesc->tupDesc);
+    /* sanity checks */
+    Assert(queryDesc != NULL);
 
     /*
-     * run plan
+     * Queries that cannot see a protected relation run through the regular
+     * executor untouched.
      */
-    if (!ScanDirectionIsNoMovement(direction))
-        ExecutePlan(estate,
-                    queryDesc->planstate,
-                    queryDesc->plannedstmt->parallelModeNeeded,
-                    operation,
-                    sendTuples,
-                    count,
-                    direction,
-                    dest);
+    qstate = lookup_query(queryDesc);
+    if (qstate == NULL)
+    {
+        if (prev_ExecutorRun_hook)
+            prev_ExecutorRun_hook(IPM_EXECUTOR_RUN_ARGS);
+        else
+            standard_ExecutorRun(IPM_EXECUTOR_RUN_ARGS);
+        return;
+    }
+
+    dest = queryDesc->dest;
+
+    receiver = &qstate->receiver;
+    receiver->pub.mydest = dest->mydest;
+    receiver->inner = dest;
+    receiver->tuplecxt = GetPerTupleMemoryContext(queryDesc->estate);
+    receiver->inner_open = true;
+
+    queryDesc->dest = &receiver->pub;
+
+#ifdef IPM_HAVE_EXECUTE_ONCE
 
     /*
-     * shutdown tuple receiver, if we started it
+     * The rows of a bounded run that is the only one the query gets are
+     * all that will ever be fetched.  Tell the plan, as a Limit node
+     * would, so that sorts keep only the top rows and parallel workers,
+     * which perturb what they send, stop at the count, too.
      */
-    if (sendTuples)
-        (*dest->rShutdown) (dest);
+    if (execute_once && count > 0 && !queryDesc->already_executed &&
+        ScanDirectionIsForward(direction))
+        ExecSetTupleBound((int64) count, queryDesc->planstate);
+#endif
 
-    if (queryDesc->totaltime)
-        InstrStopNode(queryDesc->totaltime, estate->es_processed);
-
-    MemoryContextSwitchTo(oldcontext);
+    PG_TRY();
+    {
+        if (prev_ExecutorRun_hook)
+            prev_ExecutorRun_hook(IPM_EXECUTOR_RUN_ARGS);
+        else
+            standard_ExecutorRun(IPM_EXECUTOR_RUN_ARGS);
+    }
+    PG_FINALLY();
+    {
+        queryDesc->dest = dest;
+    }
+    PG_END_TRY();
 }
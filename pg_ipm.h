@@ -0,0 +1,256 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_ipm.h
+ *
+ * Declarations shared between the pg_ipm source files.
+ *
+ * Copyright 2022 Ernst-Georg Schmid
+ *
+ * Distributed under The PostgreSQL License
+ * see License file for terms
+ *-------------------------------------------------------------------------
+ */
+#ifndef PG_IPM_H
+#define PG_IPM_H
+
+#include "access/attnum.h"
+#include "nodes/pg_list.h"
+#include "storage/itemptr.h"
+#include "utils/guc.h"
+
+#include "ipm_compat.h"
+
+/* Noise distributions of a rule */
+typedef enum IpmDistribution
+{
+    IPM_DIST_UNIFORM,           /* uniform in [-scale, scale] */
+    IPM_DIST_LAPLACE,           /* Laplace with parameter b = scale */
+    IPM_DIST_GAUSSIAN           /* normal with standard deviation scale */
+} IpmDistribution;
+
+/*
+ * The noise of a rule, "uniform(5)" unless the rule says otherwise.  clamp
+ * bounds the column's values in sums perturbed as a whole, see
+ * ipm_planner.c; 0 if the rule has none.
+ */
+typedef struct IpmNoiseSpec
+{
+    IpmDistribution dist;
+    float8      scale;
+    float8      clamp;
+} IpmNoiseSpec;
+
+#define IPM_DEFAULT_SCALE 5.0
+#define IPM_MAX_SCALE 1000000.0
+#define IPM_MAX_CLAMP 1.0e15
+
+/*
+ * A kernel takes the original value of a protected column and a 64 bit
+ * noise word and returns the value to be emitted instead, with noise of
+ * the given distribution.
+ */
+typedef Datum (*IpmKernel) (Datum value, uint64 word, const IpmNoiseSpec *noise);
+
+/*
+ * A batch kernel does the same for an array of non-null values in place,
+ * with one word per value.
+ */
+typedef void (*IpmBatchKernel) (Datum *values, const uint64 *words, int nvalues,
+                                const IpmNoiseSpec *noise);
+
+/*
+ * One protected column of a relation, resolved in the backend's database.
+ * typid is the base type if the column's type is a domain.  owner and
+ * ident identify the column for keyed noise: the relation the rule is
+ * configured on and the column's attnum there, which differ from relid
+ * and attnum for rules inherited by a partition.  noise is the rule's
+ * distribution.
+ */
+typedef struct IpmColumnRule
+{
+    AttrNumber  attnum;
+    Oid         typid;
+    int16       typlen;
+    bool        typbyval;
+    Oid         owner;
+    AttrNumber  ident;
+    IpmNoiseSpec noise;
+} IpmColumnRule;
+
+/*
+ * All rules of one relation.  This is the entry type of the backend-local
+ * rule hash; relid is the hash key.  columns is sorted by attnum.
+ */
+typedef struct IpmRelationRules
+{
+    Oid         relid;
+    int         ncolumns;
+    IpmColumnRule *columns;
+} IpmRelationRules;
+
+/* Values of pg_ipm.mode */
+typedef enum IpmMode
+{
+    IPM_MODE_EXECUTOR,          /* perturb slots as they are emitted */
+    IPM_MODE_PLANNER            /* compile into the output expressions */
+} IpmMode;
+
+/* Values of pg_ipm.noise */
+typedef enum IpmNoise
+{
+    IPM_NOISE_RANDOM,           /* fresh noise on every execution */
+    IPM_NOISE_KEYED             /* keyed hash of row and column identity */
+} IpmNoise;
+
+/* Values of pg_ipm.aggregates */
+typedef enum IpmAggregates
+{
+    IPM_AGGREGATES_INPUT,       /* perturb every value an aggregate reads */
+    IPM_AGGREGATES_RESULT       /* perturb the result of each group once */
+} IpmAggregates;
+
+/* Values of pg_ipm.budget_exhausted */
+typedef enum IpmBudgetPolicy
+{
+    IPM_BUDGET_ERROR,           /* queries over budget fail */
+    IPM_BUDGET_COARSEN          /* they run with coarse noise */
+} IpmBudgetPolicy;
+
+/* How much coarse noise scales up a rule's noise */
+#define IPM_COARSE_FACTOR 10.0
+
+/* What pg_ipm.policies says about a role */
+typedef struct IpmPolicy
+{
+    bool        exempt;         /* its queries are not perturbed */
+    float8      factor;         /* scales the noise of every rule */
+} IpmPolicy;
+
+/* Upper limit of pg_ipm.batch_size */
+#define IPM_MAX_BATCH_SIZE 8192
+
+/* Batch size of COPY TO while pg_ipm.batch_size is 0 */
+#define IPM_COPY_BATCH_SIZE 1024
+
+/*
+ * The activity counters of a backend, since its last transaction end.
+ * Every member is a uint64; pg_stat_ipm relies on that.  perturb_time is
+ * in nanoseconds.
+ */
+typedef struct IpmStats
+{
+    uint64      queries_bypassed;   /* queries reading no protected relation */
+    uint64      queries_perturbed;
+    uint64      tuples_inspected;
+    uint64      tuples_perturbed;
+    uint64      nulls_skipped;
+    uint64      perturb_time;
+    uint64      memo_hits;
+    uint64      memo_misses;
+} IpmStats;
+
+/* Every how many tuples or batches the perturbation is timed */
+#define IPM_TIMING_INTERVAL 1024
+
+/*
+ * What EXPLAIN ANALYZE shows about the query it runs.  The executor hooks
+ * fill it in for the first query started while ipm_explain_query points
+ * to it.  The counts are those of the leader; parallel workers perturb
+ * their tuples on their own.
+ */
+typedef struct IpmExplainInfo
+{
+    bool        started;        /* the explained query has started */
+    bool        executor;       /* it was a query executor mode handles */
+    int         nrules;         /* distinct rules applied */
+    uint64      tuples_perturbed;
+    double      perturb_time;   /* in milliseconds */
+} IpmExplainInfo;
+
+/* pg_ipm.c */
+extern int	ipm_mode;
+extern int	ipm_noise;
+extern int	ipm_aggregates;
+extern double ipm_sample_rate;
+extern int	ipm_batch_size;
+
+/* ipm_budget.c */
+extern int	ipm_max_roles;
+extern double ipm_epsilon_per_query;
+extern double ipm_epsilon_per_day;
+extern int	ipm_budget_policy;
+extern bool ipm_query_coarse;
+
+extern void ipm_budget_init(void);
+extern void ipm_budget_fini(void);
+extern bool ipm_budget_charge(struct PlannedStmt *plannedstmt, float8 factor);
+
+/* ipm_copy.c */
+extern void ipm_copy_init(void);
+extern void ipm_copy_fini(void);
+
+/* ipm_decode.c */
+extern char *ipm_decoding_plugin;
+
+/* ipm_explain.c */
+extern IpmExplainInfo *ipm_explain_query;
+
+extern void ipm_explain_init(void);
+extern void ipm_explain_fini(void);
+
+/* ipm_kernels.c */
+extern const char *ipm_kernel_isa;
+
+extern void ipm_kernels_init(void);
+extern float8 ipm_exponential(uint64 word);
+extern bool ipm_lookup_kernels(Oid typid, IpmKernel *kernel,
+                               IpmBatchKernel *batch_kernel);
+
+/* ipm_policy.c */
+extern char *ipm_policies;
+
+extern bool ipm_check_policies(char **newval, void **extra, GucSource source);
+extern void ipm_assign_policies(const char *newval, void *extra);
+extern const IpmPolicy *ipm_current_policy(void);
+
+/* ipm_rules.c */
+extern char *ipm_rules;
+extern int	ipm_max_rules;
+
+extern bool ipm_check_rules(char **newval, void **extra, GucSource source);
+extern void ipm_assign_rules(const char *newval, void *extra);
+extern void ipm_rules_init(void);
+extern void ipm_rules_fini(void);
+extern void ipm_rules_refresh(void);
+extern bool ipm_split_rules(char *rawstring, List **elemlist);
+extern IpmColumnRule *ipm_find_rule_column(IpmRelationRules *rules,
+                                           AttrNumber attnum);
+extern IpmRelationRules *ipm_lookup_inherited_rules(Oid relid);
+
+/* ipm_memo.c */
+extern int	ipm_memo_size;
+
+extern bool ipm_memo_lookup(Oid owner, AttrNumber ident, Oid tableoid,
+                            ItemPointer tid, float8 scale, Datum value,
+                            Datum *result);
+extern void ipm_memo_store(Oid owner, AttrNumber ident, Oid tableoid,
+                           ItemPointer tid, float8 scale, Datum value,
+                           Datum result);
+extern void ipm_memo_reset(void);
+extern void ipm_assign_memo_size(int newval, void *extra);
+
+/* ipm_planner.c */
+extern void ipm_planner_init(void);
+extern void ipm_planner_fini(void);
+extern void ipm_assign_aggregates(int newval, void *extra);
+extern void ipm_assign_mode(int newval, void *extra);
+
+/* ipm_stats.c */
+extern IpmStats ipm_stats;
+extern uint32 ipm_wait_event;
+
+extern void ipm_wait_event_init(void);
+extern void ipm_stats_init(void);
+extern void ipm_stats_fini(void);
+
+#endif							/* PG_IPM_H */
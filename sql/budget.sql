@@ -0,0 +1,21 @@
+-- A query is charged 1/scale for each Laplace protected column of the
+-- tables it reads, against the daily budget of its role.
+CREATE TABLE ledger (id int, amount int);
+INSERT INTO ledger SELECT i, 100 FROM generate_series(1, 10) i;
+CREATE TABLE journal (id int);
+INSERT INTO journal SELECT i FROM generate_series(1, 10) i;
+CREATE ROLE regress_ipm_budget;
+GRANT SELECT ON ledger, journal TO regress_ipm_budget;
+SET ROLE regress_ipm_budget;
+SELECT count(*) FROM ledger;
+SELECT count(*) FROM ledger;
+SELECT count(*) FROM ledger;
+-- That was epsilon 3, the day's budget.
+SELECT count(*) FROM ledger;
+-- Tables without Laplace rules are free.
+SELECT count(*) FROM journal;
+-- Budgets are per role.
+RESET ROLE;
+SELECT count(*) FROM ledger;
+DROP TABLE ledger, journal;
+DROP ROLE regress_ipm_budget;
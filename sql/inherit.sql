@@ -0,0 +1,20 @@
+-- Rules of a partitioned table apply to its partitions, together with
+-- the partitions' own rules.  emp_p2 numbers its columns differently.
+CREATE TABLE emp_parted (id int, salary int, bonus int) PARTITION BY RANGE (id);
+CREATE TABLE emp_p1 PARTITION OF emp_parted FOR VALUES FROM (1) TO (101);
+CREATE TABLE emp_p2 (bonus int, id int, salary int);
+ALTER TABLE emp_parted ATTACH PARTITION emp_p2 FOR VALUES FROM (101) TO (201);
+INSERT INTO emp_parted SELECT i, 1000 + i, 100 + i FROM generate_series(1, 200) i;
+CREATE TEMP TABLE seen_p1 AS SELECT * FROM emp_parted WHERE id <= 100;
+SELECT count(*) AS nrows,
+       count(*) FILTER (WHERE s.salary <> t.salary) > 0 AS salary_perturbed,
+       count(*) FILTER (WHERE s.bonus <> t.bonus) AS bonus_changed
+FROM seen_p1 s JOIN emp_p1 t USING (id);
+-- A partition with rules of its own keeps those of its parent.
+CREATE TEMP TABLE seen_p2 AS SELECT * FROM emp_p2;
+SELECT count(*) AS nrows,
+       count(*) FILTER (WHERE s.salary <> t.salary) > 0 AS salary_perturbed,
+       max(abs(s.salary - t.salary)) <= 5 AS salary_in_scale,
+       count(*) FILTER (WHERE s.bonus <> t.bonus) > 0 AS bonus_perturbed,
+       count(*) FILTER (WHERE s.id <> t.id) AS id_changed
+FROM seen_p2 s JOIN emp_p2 t USING (id);
@@ -0,0 +1,24 @@
+-- ipm_perturb() serves only the calls planner mode makes.  Called by
+-- hand it would reveal the keyed noise of a row, and with it the value.
+SET pg_ipm.noise = keyed;
+SELECT salary - ipm_perturb(0, 'staff'::regclass, 2::int2, tableoid, ctid)
+FROM staff;
+SELECT ipm_perturb(1000, 'staff'::regclass, 2::int2);
+-- Executor mode still perturbs, with the same noise in every execution.
+CREATE TEMP TABLE seen_keyed1 AS SELECT * FROM staff;
+CREATE TEMP TABLE seen_keyed2 AS SELECT * FROM staff;
+SELECT count(*) FILTER (WHERE a.salary <> t.salary) > 0 AS salary_perturbed,
+       count(*) FILTER (WHERE a.salary <> b.salary) AS runs_differ
+FROM seen_keyed1 a JOIN seen_keyed2 b USING (id) JOIN staff t USING (id);
+-- pg_ipm.memo_size remembers the keyed values of rows read again.
+ALTER TABLE staff SET (autovacuum_enabled = off);
+SET pg_ipm.memo_size = '1MB';
+SELECT pg_stat_ipm_reset();
+CREATE TEMP TABLE seen_memo1 AS SELECT * FROM staff;
+CREATE TEMP TABLE seen_memo2 AS SELECT * FROM staff;
+SELECT memo_hits, memo_misses FROM pg_stat_ipm;
+SELECT count(*) FILTER (WHERE a.salary <> b.salary) AS runs_differ
+FROM seen_memo1 a JOIN seen_memo2 b USING (id);
+RESET pg_ipm.memo_size;
+ALTER TABLE staff RESET (autovacuum_enabled);
+RESET pg_ipm.noise;
@@ -0,0 +1,83 @@
+CREATE EXTENSION pg_ipm;
+
+CREATE TABLE staff (id int PRIMARY KEY, salary int, bonus int, rate float8);
+INSERT INTO staff SELECT i, 1000 + i, 100 + i, i / 4.0 FROM generate_series(1, 200) i;
+CREATE TABLE plain (id int PRIMARY KEY, salary int);
+INSERT INTO plain SELECT i, 1000 + i FROM generate_series(1, 200) i;
+
+-- Protected columns get noise within the scale of their rule,
+-- unprotected columns of the same table are left alone.
+CREATE TEMP TABLE seen_staff AS SELECT * FROM staff;
+SELECT count(*) AS nrows,
+       count(*) FILTER (WHERE s.salary <> t.salary) > 0 AS salary_perturbed,
+       max(abs(s.salary - t.salary)) <= 5 AS salary_in_scale,
+       max(abs(s.rate - t.rate)) <= 0.5 + 1e-9 AS rate_in_scale,
+       count(*) FILTER (WHERE s.bonus <> t.bonus) AS bonus_changed
+FROM seen_staff s JOIN staff t USING (id);
+
+-- Unprotected tables bypass pg_ipm.
+CREATE TEMP TABLE seen_plain AS SELECT * FROM plain;
+SELECT count(*) FILTER (WHERE s.salary <> t.salary) AS salary_changed
+FROM seen_plain s JOIN plain t USING (id);
+
+-- Members of an exempt role read the stored values.
+CREATE ROLE regress_ipm_exempt;
+GRANT SELECT ON staff TO regress_ipm_exempt;
+SET ROLE regress_ipm_exempt;
+CREATE TEMP TABLE seen_exempt AS SELECT * FROM staff;
+RESET ROLE;
+SELECT count(*) FILTER (WHERE s.salary <> t.salary) AS salary_changed
+FROM seen_exempt s JOIN staff t USING (id);
+
+-- COPY TO exports perturbed values, COPY FROM stores them as they are.
+\copy staff TO 'results/staff.copy'
+CREATE TEMP TABLE copied_staff (LIKE staff);
+\copy copied_staff FROM 'results/staff.copy'
+SELECT count(*) AS nrows,
+       count(*) FILTER (WHERE s.salary <> t.salary) > 0 AS salary_perturbed,
+       max(abs(s.salary - t.salary)) <= 5 AS salary_in_scale,
+       count(*) FILTER (WHERE s.bonus <> t.bonus) AS bonus_changed
+FROM copied_staff s JOIN staff t USING (id);
+-- A column list is applied to the perturbed rows.
+\copy staff (id, salary) TO 'results/staff_cols.copy'
+CREATE TEMP TABLE copied_cols (id int, salary int);
+\copy copied_cols FROM 'results/staff_cols.copy'
+SELECT count(*) AS nrows,
+       count(*) FILTER (WHERE s.salary <> t.salary) > 0 AS salary_perturbed,
+       max(abs(s.salary - t.salary)) <= 5 AS salary_in_scale
+FROM copied_cols s JOIN staff t USING (id);
+
+-- pg_ipm.sample_rate is the share of rows perturbed, pg_stat_ipm counts
+-- them.
+SELECT pg_stat_ipm_reset();
+SET pg_ipm.sample_rate = 0;
+CREATE TEMP TABLE seen_none AS SELECT * FROM staff;
+SET pg_ipm.sample_rate = 1;
+CREATE TEMP TABLE seen_all AS SELECT * FROM staff;
+RESET pg_ipm.sample_rate;
+SELECT queries_perturbed, tuples_inspected, tuples_perturbed, nulls_skipped
+FROM pg_stat_ipm;
+SELECT count(*) FILTER (WHERE s.salary <> t.salary) AS salary_changed
+FROM seen_none s JOIN staff t USING (id);
+SELECT count(*) FILTER (WHERE s.salary <> t.salary) > 0 AS salary_perturbed,
+       max(abs(s.salary - t.salary)) <= 5 AS salary_in_scale
+FROM seen_all s JOIN staff t USING (id);
+
+-- EXPLAIN VERBOSE shows how pg_ipm runs, EXPLAIN ANALYZE what it did.
+-- The kernels depend on the CPU.
+CREATE FUNCTION ipm_explained(options text, query text) RETURNS SETOF text
+LANGUAGE plpgsql AS $$
+DECLARE
+    line text;
+BEGIN
+    FOR line IN EXECUTE 'EXPLAIN (' || options || ') ' || query LOOP
+        IF line LIKE 'IPM %' AND line NOT LIKE 'IPM Kernel: %' THEN
+            RETURN NEXT line;
+        END IF;
+    END LOOP;
+END
+$$;
+SELECT ipm_explained('VERBOSE', 'SELECT * FROM staff');
+SELECT ipm_explained('ANALYZE, TIMING OFF', 'SELECT * FROM staff');
+SELECT ipm_explained('ANALYZE, TIMING OFF', 'SELECT * FROM plain');
+DROP FUNCTION ipm_explained(text, text);
@@ -0,0 +1,54 @@
+-- Planner mode compiles the perturbation into the queries themselves.
+SET pg_ipm.mode = planner;
+-- Projected columns, which executor mode cannot trace back to the table.
+CREATE TEMP TABLE seen_cols AS SELECT id, salary, bonus FROM staff;
+SELECT count(*) AS nrows,
+       count(*) FILTER (WHERE s.salary <> p.salary) > 0 AS salary_perturbed,
+       max(abs(s.salary - p.salary)) <= 5 AS salary_in_scale,
+       count(*) FILTER (WHERE s.bonus <> 100 + s.id) AS bonus_changed
+FROM seen_cols s JOIN plain p USING (id);
+-- Quals see the stored values.
+SELECT count(*) FROM staff WHERE salary = 1001;
+-- SQL functions are not inlined; their queries are perturbed on their own.
+CREATE FUNCTION staff_rows() RETURNS SETOF staff LANGUAGE sql STABLE
+AS 'SELECT * FROM staff';
+CREATE TEMP TABLE seen_fn AS SELECT * FROM staff_rows();
+SELECT count(*) AS nrows,
+       count(*) FILTER (WHERE s.salary <> p.salary) > 0 AS salary_perturbed,
+       max(abs(s.salary - p.salary)) <= 5 AS salary_in_scale
+FROM seen_fn s JOIN plain p USING (id);
+DROP FUNCTION staff_rows();
+-- RETURNING lists are perturbed, in data-modifying CTEs too.
+WITH d AS (UPDATE staff SET bonus = bonus RETURNING id, salary)
+SELECT count(*) AS nrows,
+       count(*) FILTER (WHERE d.salary <> p.salary) > 0 AS salary_perturbed,
+       max(abs(d.salary - p.salary)) <= 5 AS salary_in_scale
+FROM d JOIN plain p USING (id);
+BEGIN;
+\copy (DELETE FROM staff RETURNING id, salary) TO 'results/deleted.copy'
+ROLLBACK;
+CREATE TEMP TABLE deleted (id int, salary int);
+\copy deleted FROM 'results/deleted.copy'
+SELECT count(*) AS nrows,
+       count(*) FILTER (WHERE s.salary <> p.salary) > 0 AS salary_perturbed,
+       max(abs(s.salary - p.salary)) <= 5 AS salary_in_scale
+FROM deleted s JOIN plain p USING (id);
+-- With pg_ipm.aggregates = result, count gets the noise of the column once
+-- per group, uniform(5) for salary.
+CREATE TEMP TABLE seen_counts AS
+SELECT id, count(salary) AS n FROM staff GROUP BY id;
+SELECT count(*) AS ngroups,
+       count(*) FILTER (WHERE n <> 1) > 0 AS count_perturbed,
+       max(abs(n - 1)) <= 5 AS count_in_scale
+FROM seen_counts;
+-- sum clamps its input to the rule's clamp(10) and scales the noise by it.
+CREATE TABLE payments (id int, amount int);
+INSERT INTO payments SELECT i, i FROM generate_series(1, 200) i;
+CREATE TEMP TABLE seen_sums AS
+SELECT id, sum(amount) AS total FROM payments GROUP BY id;
+SELECT count(*) AS ngroups,
+       count(*) FILTER (WHERE total <> least(id, 10)) > 0 AS sum_perturbed,
+       max(abs(total - least(id, 10))) <= 10 AS sum_in_scale
+FROM seen_sums;
+DROP TABLE payments;
+RESET pg_ipm.mode;